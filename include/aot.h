@@ -0,0 +1,66 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* Ahead of time compiled ROMs
+    tools/gb2c.c walks the reachable code of a cartridge and writes one C
+    function per basic block, keyed by (rom bank, address). That file is
+    compiled into a shared object and loaded with `-aot rom.so`.
+    Blocks only remove the fetch/decode of the interpreter, every
+    instruction still goes through read8/write8 and cpu_retire, so timing
+    is the same as cpu_step. Anything the tool did not find (RAM code,
+    banks it could not follow, the bootrom) runs on the interpreter.
+*/
+
+#define AOT_VERSION 2
+
+struct CPU;
+typedef struct CPU CPU;
+
+// what the generated object exports
+typedef int (*aot_dispatch_fn)(CPU *cpu, uint32_t bank, uint16_t pc);
+#define AOT_DISPATCH_SYMBOL "admge_aot_dispatch"
+#define AOT_VERSION_SYMBOL  "admge_aot_version"
+#define AOT_CPU_SIZE_SYMBOL "admge_aot_cpu_size"
+#define AOT_ROM_ID_SYMBOL   "admge_aot_rom_id"
+
+/* The cartridge an object was compiled from: its title (0x134-0x143), the
+   header checksum (0x14D) and the global checksum (0x14E-0x14F). The rom
+   has to be at least 0x150 bytes. */
+#define AOT_ROM_ID_SIZE 19
+
+static inline void aot_rom_id(const uint8_t *rom, uint8_t id[AOT_ROM_ID_SIZE]) {
+    memcpy(id, &rom[0x134], 16);
+    memcpy(&id[16], &rom[0x14D], 3);
+}
+
+/* Banking state a block was entered with. A block leaves as soon as an
+   instruction switches banks, raises an interrupt that will be taken,
+   halts, or starts an OAM DMA or an HDMA that holds the CPU up. The next
+   cpu_step sorts out where to go from there. The inlined immediates read
+   the ROM at compile time, so no block runs while a DMA could put a bus
+   conflict on them. */
+typedef struct {
+    uint8_t rom;
+    uint8_t ram;
+    uint8_t mode;
+} AotBanks;
+
+#define AOT_ENTER(cpu) \
+    ((AotBanks){ (cpu)->curr_rom_bank, (cpu)->curr_ram_bank, (cpu)->bank_mode })
+
+#define AOT_LEAVE(cpu, b) \
+    ((cpu)->halted || ((cpu)->ime && ((cpu)->iflag & (cpu)->ie & 0x1F)) || \
+     (cpu)->curr_rom_bank != (b).rom || (cpu)->curr_ram_bank != (b).ram || \
+     (cpu)->bank_mode != (b).mode || (cpu)->stall || (cpu)->dma_active)
+
+extern bool aot_enabled;
+
+extern bool aot_load(const char *path);
+extern void aot_unload(void);
+extern bool aot_run(CPU *cpu);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef AUDIO_RING_H
+#define AUDIO_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/* Audio between the core and the SDL audio callback
+    Single producer (the APU, once per audio frame), single consumer (the
+    callback), lock-free. head and tail only ever grow, a frame's slot is
+    (index & mask). Both sides copy whole runs with memcpy and move their
+    index once per call, not once per sample.
+    head and tail get a cache line each and the ring isn't part of CPU, so
+    the callback doesn't pull in the lines the core is working on.
+
+    Counts are stereo frames, an L and an R int16 each.
+*/
+
+#define AUDIO_RING_FRAMES 2048 // must be a power of two
+// Most the APU writes in one go: a 70224 T-cycle audio frame is ~739 at 44.1 kHz,
+// a few more with -drc. Whoever paces the core has to leave that much room.
+#define AUDIO_RING_BATCH 768
+
+typedef struct {
+    _Alignas(64) atomic_size_t head; // moved by the producer
+    _Alignas(64) atomic_size_t tail; // moved by the consumer
+    _Alignas(64) int16_t samples[AUDIO_RING_FRAMES * 2];
+} AudioRing;
+
+extern AudioRing audio_ring;
+
+// producer: up to count frames in, returns how many fit
+extern size_t audio_ring_write(AudioRing *ring, const int16_t *frames, size_t count);
+// consumer: up to count frames out, returns how many there were
+extern size_t audio_ring_read(AudioRing *ring, int16_t *frames, size_t count);
+// frames waiting, from either side
+extern size_t audio_ring_fill(AudioRing *ring);
+
+#endif
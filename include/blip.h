@@ -0,0 +1,39 @@
+#ifndef BLIP_H
+#define BLIP_H
+
+#include <stdint.h>
+
+/* Band-limited step synthesis, the way blip_buf does it.
+    The APU's output only ever jumps from one level to another. Point sampling
+    that aliases every jump that doesn't land on a sample. Here every jump goes
+    into the sample buffer as a delta, spread over BLIP_WIDTH samples by a
+    windowed sinc kernel picked for the sub-sample spot it happened at.
+    Reading integrates the deltas back into a waveform, a whole frame at once.
+    It's stereo: a delta has a left and a right half, they share the kernel
+    lookup and sit next to each other in the buffer, read gives L/R frames.
+
+    Times are clocks (T-cycles) from the start of the frame being made, the
+    clock and sample rates can be anything, only their ratio is used.
+*/
+
+#define BLIP_WIDTH 16          // samples a delta is spread over
+#define BLIP_PHASES 32         // sub-sample spots a delta can land on
+#define BLIP_MAX_SAMPLES 4096  // frames per frame, a 70224 clock frame is under 800 at 48 kHz
+
+typedef struct {
+    uint64_t factor;   // samples per clock, 32.32 fixed point
+    uint64_t offset;   // fraction of a sample the frame starts at, same format
+    int avail;         // frames finished by blip_end_frame, not read yet
+    int32_t integrator[2];
+    int32_t buffer[(BLIP_MAX_SAMPLES + BLIP_WIDTH) * 2]; // L, R, L, R, ...
+} Blip;
+
+extern void blip_init(Blip *blip, double clock_rate, double sample_rate);
+// A new ratio, only between frames: the deltas of a frame all use the same one
+extern void blip_set_rates(Blip *blip, double clock_rate, double sample_rate);
+extern void blip_add_delta(Blip *blip, uint32_t time, int left, int right);
+extern void blip_end_frame(Blip *blip, uint32_t clocks);
+// up to count L/R frames into out, returns how many there were
+extern int blip_read_samples(Blip *blip, int16_t *out, int count);
+
+#endif
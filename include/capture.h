@@ -0,0 +1,35 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "cpu.h"
+
+/* Video capture, works without a window (-test) too
+    Every published frame's pixels are copied into a small queue and a
+    writer thread turns them into the output. If the writer falls behind
+    frames are dropped, the core never waits on the disk or the pipe.
+    The output has a frame for every frame period (70224 dots) all the same:
+    periods whose frame was skipped, dropped or never drawn (lcd off) repeat
+    the one before, so the timing holds and png numbers are frame periods.
+
+    Formats, picked by the file extension (a pipe gets y4m):
+        y4m  YUV4MPEG2, 4:4:4 at the real 59.73 fps, ffmpeg/mpv read it as is
+        raw  anything else, packed RGB24 160x144, one frame after the other
+        png  one file per frame, out.png becomes out_000000.png, ...
+
+    A path starting with '|' is a command the stream is piped into,
+    e.g. "|ffmpeg -i - out.mp4".
+*/
+
+#define CAPTURE_QUEUE_SIZE 16// frames, must be a power of two
+
+extern bool capture_enabled;
+
+// interval: only every interval'th frame period is kept
+extern bool capture_open(const char *path, int interval);
+extern void capture_close(void);
+
+// Called by the PPU with every frame it publishes. colours: what the shades
+// go through when the frame has no pixels (-indexed), NULL otherwise
+extern void capture_frame(const Frame *frame, const uint32_t colours[4]);
+
+#endif
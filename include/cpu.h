@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdatomic.h>
+#include "blip.h"
 
 /* A Note about the Clock and Cycles
     Every op will take a certain amount of m-cycles
@@ -42,10 +43,10 @@
 #define FREQUENCY 440           
 #define SAMPLE_RATE 44100
 #define CPU_FREQUENCY 4194304 
-#define AUDIO_BUFFER_SIZE 4096
-#define CYCLES_PER_SAMPLE (CPU_FREQUENCY / SAMPLE_RATE)
 
-extern const uint32_t* GAMEBOY_COLOURS;
+/* The P key switches it on the UI thread while the core, the render thread
+   and the presenter draw with it: read it once and stick with that. */
+extern _Atomic(const uint32_t *) GAMEBOY_COLOURS;
 
 
 // Sprite struct - used in PPU
@@ -65,6 +66,68 @@ typedef struct{
     long last;
 } RTC;
 
+// A whole picture, see the triple buffer in PPU
+typedef struct {
+    uint32_t seq; // counts published frames, 0 is the blank one from ppu_init
+    uint32_t period; // the frame period it was finished in, see periods in PPU
+    uint8_t shades[SCREEN_WIDTH * SCREEN_HEIGHT];
+    uint32_t pixels[SCREEN_WIDTH * SCREEN_HEIGHT];
+} Frame;
+
+#define FRAME_NEW 0x04
+
+// The registers that decide how a line looks, as they were when mode 3 started
+typedef struct {
+    uint8_t lcdc, scy, scx, bgp, obp0, obp1, wy, wx;
+} LineRegs;
+
+// A PPU register write that landed while a line was being drawn
+typedef struct {
+    uint16_t dot;  // T-cycles into mode 3
+    uint8_t reg;   // low byte of the address
+    uint8_t value;
+} RegWrite;
+
+#define MODE3_LOG_SIZE 64
+
+// What the fast path draws a line from, fixed when the line is drawn
+typedef struct {
+    LineRegs regs;
+    uint8_t ly;
+    uint8_t wly;      // window line, when the window is on this line
+    bool window;
+    uint8_t obj_count;
+    Sprite objs[10];  // the line's objects, sorted by x
+    uint8_t obj_index[10]; // where they are in OAM, that's their priority on CGB
+} LineState;
+
+/* Where the fast path gets tiles from: the PPU's own cache on the core thread,
+   a render worker's copy otherwise. layer_cpu is only set on the core thread
+   with -layers, bg and window lines are then copied out of its layers.
+   vram1 is VRAM bank 1 in CGB mode, NULL otherwise, its tiles follow bank 0's. */
+typedef struct {
+    const uint8_t *vram; // $8000-$9FFF
+    uint8_t (*tiles)[8][8];
+    uint8_t (*tiles_xflip)[8][8];
+    struct CPU *layer_cpu;
+    const uint8_t *vram1;
+} TileSource;
+
+/* Everything a line drawn by the fast path depends on. Memory that it reads is
+   stood in for by generation counters of the map row and tile blocks it used,
+   and on CGB of the colour palettes. Compared with memcmp, so it gets zeroed first. */
+typedef struct {
+    LineState line;
+    uint32_t bg_map_gen;
+    uint32_t win_map_gen;
+    uint32_t tile_gen[6];
+    uint32_t palette_gen;
+    const uint32_t *colours;
+} LineKey;
+
+#define FRAMESKIP_AUTO -1
+#define FRAMESKIP_AUTO_MAX 4 // auto still draws at least one frame in this many + 1
+
 /* Struct for the PPU */
 typedef struct PPU{
 
@@ -90,14 +153,103 @@ typedef struct PPU{
     /*The framebuffer gets updated when the Scanlines are finshed.
       This happens when when the scanline reaches line 144. This is kept track of by the ly register.
       The PPU then triggers a VBlank interrupt, which causes the framebuffer to update*/
-    uint32_t framebuffer[SCREEN_WIDTH * SCREEN_HEIGHT];
+    uint32_t *framebuffer; // frames[back].pixels, the frame being drawn
+
+    /* Shade (0-3) of every pixel, always written. In indexed mode the core
+       stops here and leaves framebuffer alone, whoever shows the frame
+       expands the shades (present_screen does it with GAMEBOY_COLOURS).
+       On CGB a shade is an index into cgb_colours instead, see ppu_cgb.c. */
+    uint8_t *shades;       // frames[back].shades
+    bool indexed;
+
+    /* Triple buffer between the core and whoever shows the frames.
+       The core draws into frames[back] and trades it for the middle slot at LY 144,
+       ppu_acquire_frame trades front for middle when that holds a newer frame.
+       frame_state is the middle slot, plus FRAME_NEW until it gets picked up. */
+    Frame frames[3];
+    uint8_t back;
+    uint8_t front;
+    atomic_uint frame_state;
+    uint32_t frame_seq;
+
+    /* Frame periods gone by: every VBlank, and every 70224 dots with the lcd off.
+       Skipped and dropped frames take their period too, capture goes by it. */
+    uint32_t periods;
+    int off_dots;
+
+    /* OAM scan results for every line: up to 10 OAM indices, sorted by x.
+       Rebuilt before the next line is drawn once OAM or the object size changed. */
+    uint8_t line_objs[SCREEN_HEIGHT][10];
+    uint8_t line_obj_count[SCREEN_HEIGHT];
+    bool oam_dirty;
+
+    /* Mode 3 takes longer with fine scroll, the window and objects on the line.
+       Register writes during it are logged and such a line is drawn by the
+       pixel FIFO (ppu_fifo.c), every other line by the whole-line renderer. */
+    int mode3_length;
+    LineRegs line_regs;
+    RegWrite mode3_log[MODE3_LOG_SIZE];
+    int mode3_log_len;
+    bool fifo_always; // -fifo, every line through the FIFO
+
+    /* Frame skip: a skipped frame runs every mode, interrupt and access rule as
+       usual, only the pixels aren't drawn and it never gets published.
+       frameskip is 0 (off), N (skip N after every drawn frame) or FRAMESKIP_AUTO,
+       which skips while running_late says the host missed a frame deadline. */
+    int frameskip;
+    bool running_late;   // set by whoever paces the core
+    bool skip_frame;     // the frame being drawn now is skipped
+    int skip_run;        // frames skipped in a row
+    uint32_t frames_skipped;
+
+    /* Line memoisation: line_keys holds what each line of the last published
+       frame was drawn from. A line whose key hasn't changed is copied out of that
+       frame rather than drawn again. VRAM writes that change a byte bump the
+       generation of its tile map row or 128 tile block. */
+    LineKey line_keys[SCREEN_HEIGHT];
+    bool line_key_valid[SCREEN_HEIGHT];
+    bool line_reused[SCREEN_HEIGHT]; // for the frame being drawn
+    uint32_t map_gen[2][32];  // CGB attribute writes bump the same rows
+    uint32_t tile_gen[6];     // 3-5 are the blocks in VRAM bank 1
+    uint8_t published; // frames[] slot published last
+    uint64_t lines_drawn;
+    uint64_t lines_reused;
+
+    /* Decoded tile data (0x8000-0x97FF), one colour id per pixel: tiles[tile][row][x].
+       tiles_xflip holds the same rows mirrored for objects with X flip.
+       Kept in sync by ppu_write, only the row that was written gets decoded again.
+       Tiles 384 and up are VRAM bank 1, only ever written on CGB. */
+    uint8_t tiles[768][8][8];
+    uint8_t tiles_xflip[768][8][8];
+
+    /* -layers: both tile maps (0 = 9800, 1 = 9C00) composed into 256x256 colour ids,
+       a bg or window line is then a copy out of them. A layer is rebuilt 8 lines
+       (one map row) at a time, when a line needs a row marked in layer_dirty.
+       map_rows[map][n] has a bit for every map row holding tile number n, so a
+       tile data write knows which rows it dirties. Kept up to date in either mode. */
+    bool use_layers;
+    uint8_t layers[2][256][256];
+    uint32_t layer_dirty[2];
+    uint32_t map_rows[2][256];
+
+    /* CGB mode, see ppu_cgb.c. VRAM bank 0 stays in memory[], bank 1 is here.
+       Palette RAM is 8 palettes of 4 RGB555 colours each for the bg and objects,
+       cgb_colours has them as pixels: bg 0-31, objects 32-63. */
+    bool cgb;
+    uint8_t vbk;       // VRAM bank the CPU sees
+    uint8_t vram1[0x2000];
+    uint8_t bcps, ocps; // palette RAM address, bit 7 increments it on writes
+    uint8_t bg_palettes[64];
+    uint8_t obj_palettes[64];
+    uint32_t cgb_colours[64];
+    uint32_t palette_gen;
 } PPU;
 
 /* Struct for the APU */
 typedef struct APU{
-    int main_clock;
-    int frame_seq_clock;
-    
+    uint64_t synced;    // total_cycles the APU has caught up to, see apu_sync
+    uint64_t frame_end; // total_cycles the audio frame being made ends at
+
     // Registers for the four channels
     uint8_t nr10, nr11, nr12, nr13, nr14;
     uint8_t nr21, nr22, nr23, nr24;
@@ -105,7 +257,6 @@ typedef struct APU{
     uint8_t nr41, nr42, nr43, nr44;
     // control regs
     uint8_t nr50, nr51, nr52;
-    uint8_t frame_seq;
 
 
     // CH1 State
@@ -143,16 +294,22 @@ typedef struct APU{
 
     uint8_t waveform[16]; // 16 bytes
 
-    float ch1_dac_out;
-    float ch2_dac_out;
-    float ch3_dac_out;
-    float ch4_dac_out;
-
-    double sample_counter;
-    int16_t internal_buffer[4096];
-    atomic_int write_pos;
-    atomic_int read_pos;
-
+    int ch1_dac_out; // -15 to 15, 0 while the channel is off
+    int ch2_dac_out;
+    int ch3_dac_out;
+    int ch4_dac_out;
+
+    // the mixed output goes through blip_buf style synthesis, see apu_sync
+    Blip blip;
+    int mix_left, mix_right; // last levels handed to blip
+    double rate_adjust;  // -drc: samples are made at SAMPLE_RATE * this, from the next audio frame on
+    bool mix_dirty;      // something that goes into the mix changed since
+    // -highpass: the DC blocking capacitor real hardware has on its output
+    bool highpass;
+    int32_t capacitor[2];  // charge per side, Q15
+    int32_t charge_factor; // what's left of it after a sample, Q15
+    // finished frames go to audio_ring (audio_ring.h)
+    uint64_t frames_dropped; // what didn't fit into the ring
 } APU;
 
 /* Struct for the Registers a,f,b,c,d,e,h,l */
@@ -227,7 +384,31 @@ typedef struct CPU {
     // D U L R   - lower nibble is DPAD
     uint8_t joypad;
 
+    // serial port, SB and SC themselves live in memory[0xFF01/0xFF02]
+    struct Link *link;   // link cable, NULL when nothing is plugged in
+    int serial_cycles;   // T-cycles left in the running transfer, 0 when idle
+    uint8_t serial_in;   // what the other side sent back
+    bool serial_reply;   // serial_in is valid for this transfer
+
+    // OAM DMA, see dma_start in mem.c
+    uint8_t dma_reg;     // last value written to $FF46, the source page
+    bool dma_active;
+    bool dma_starting;   // started by the instruction that just ran
+    int dma_cycles;      // M-cycles into the transfer, the bytes the hardware has moved
+    int dma_copied;      // bytes really in OAM so far
+
+    // CGB, see cgb_start in mem.c
+    bool double_speed;
+    uint8_t key1;        // bit 0: switch speed at the next STOP
+    uint8_t svbk;        // WRAM bank at $D000, 1-7
+    uint8_t wram[8][0x1000]; // banks not mapped, the mapped one lives in memory[]
+    uint16_t hdma_src, hdma_dst; // dst is an offset into VRAM
+    uint8_t hdma_blocks; // 16 byte blocks left
+    bool hdma_active;    // an HBlank transfer is running
+    int stall;           // M-cycles the CPU sits out while HDMA copies
+
     uint64_t cycles;
+    uint64_t total_cycles; // T-cycles since power on, at normal speed: double speed doesn't make it go faster
 } CPU;
 
 // --------------------- flag functions
@@ -257,8 +438,14 @@ extern void clear_flags(CPU *cpu);
 extern uint8_t read8(CPU *cpu, uint16_t addr);
 extern void write8(CPU *cpu, uint16_t addr, uint8_t value);
 extern uint16_t read16(CPU *cpu, uint16_t addr);
+extern uint32_t rom_bank(CPU *cpu, uint16_t addr);
 extern void write16(CPU *cpu, uint16_t addr, uint16_t value);
 
+extern void dma_start(CPU *cpu, uint8_t value);
+extern void dma_step(CPU *cpu, int mcycles);
+extern void dma_sync(CPU *cpu);
+extern void hdma_hblank(CPU *cpu);
+
 extern void stack_push(CPU *cpu, uint16_t value);
 extern uint16_t stack_pop(CPU *cpu);
 
@@ -266,8 +453,14 @@ extern uint16_t stack_pop(CPU *cpu);
 extern void start_cpu(CPU *cpu);
 extern void start_cpu_noboot(CPU *cpu);
 extern void cpu_step(CPU *cpu);
+extern void cpu_retire(CPU *cpu, bool pending_ei);
 extern void update_rtc(CPU *cpu);
 
+// --------------------- serial functions
+extern void serial_control_write(CPU *cpu, uint8_t value);
+extern void serial_step(CPU *cpu, int tcycles);
+extern void serial_complete(CPU *cpu, uint8_t received);
+
 // --------------------- instructions
 extern void run_inst(uint8_t opcode, CPU *cpu);
 extern void run_pref_inst(CPU *cpu, uint8_t opcode);
@@ -275,17 +468,31 @@ extern void run_pref_inst(CPU *cpu, uint8_t opcode);
 // --------------------- ppu functions
 
 extern void ppu_init(PPU *ppu);
-extern void ppu_step(PPU *ppu, CPU *cpu);
+extern void ppu_step(PPU *ppu, CPU *cpu, int dots);
 extern uint8_t ppu_read(CPU *cpu, uint16_t addr);
 extern void ppu_write(CPU *cpu, uint16_t addr, uint8_t value);
+extern void ppu_write_block(CPU *cpu, uint16_t addr, const uint8_t *data);
 extern void render_scanline(PPU *ppu, CPU *cpu);
+extern void render_scanline_fifo(PPU *ppu, CPU *cpu, uint8_t *line);
+extern void decode_tile_row(const uint8_t *vram, uint8_t (*tiles)[8][8], uint8_t (*tiles_xflip)[8][8], uint16_t offset);
+extern void draw_line(const LineState *line, const TileSource *src, uint8_t *shades);
+extern void ppu_publish_frame(PPU *ppu, uint32_t period);
+extern const Frame *ppu_acquire_frame(PPU *ppu);
+extern uint64_t frame_hash(const Frame *frame);
+
+// --------------------- cgb ppu functions
+extern void ppu_cgb_init(PPU *ppu);
+extern uint8_t ppu_cgb_read(CPU *cpu, uint16_t addr);
+extern void ppu_cgb_write(CPU *cpu, uint16_t addr, uint8_t value);
+extern void draw_line_cgb(const LineState *line, const TileSource *src, uint8_t *shades);
+extern void cgb_to_argb(const PPU *ppu, const uint8_t *shades, uint32_t *out, int n);
 
 // ---------------------- apu functions
 
 extern void apu_init(APU *apu);
 extern uint8_t apu_read(CPU *cpu, uint16_t addr);
 extern void apu_write(CPU *cpu, uint16_t addr, uint8_t value);
-extern void apu_step(APU *apu, CPU *cpu);
+extern void apu_sync(APU *apu, uint64_t now);
 extern void destroy_audio();
 
 #endif 
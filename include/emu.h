@@ -30,6 +30,8 @@ extern SDL_atomic_t muted;
 extern SDL_atomic_t rom_loaded;
 
 extern bool bootrom_flag;
+extern bool cgb_flag;
+extern bool drc_flag;
 extern char serial_log[65536];
 extern char* inputRom;
 extern size_t serial_len;
@@ -0,0 +1,56 @@
+#ifndef LINK_H
+#define LINK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/* Link cable between two emulator instances.
+    The cable is two single producer / single consumer queues, one per
+    direction. The side driving the clock (SC bit 0 set) sends its SB as
+    LINK_DATA when the transfer starts, the other side answers with its own
+    SB as LINK_REPLY the next time it polls. Both sides only touch the queue
+    on transfer start/end plus one atomic load per step to poll.
+
+    The LinkChannel lives in POSIX shared memory (link_open_shared). The
+    first process creates it and sets ready once the queues are set up,
+    the second one only attaches after that.
+*/
+
+#define LINK_QUEUE_SIZE 64 // messages, must be a power of two
+#define LINK_WAIT_MS 50    // how long a master waits for the other side
+#define LINK_JOIN_MS 1000  // how long the second player waits for the channel to be set up
+
+#define LINK_DATA  1
+#define LINK_REPLY 2
+
+struct CPU;
+typedef struct CPU CPU;
+
+// message = type << 16 | seq << 8 | byte
+typedef struct {
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    _Alignas(64) uint32_t messages[LINK_QUEUE_SIZE];
+} LinkQueue;
+
+typedef struct {
+    atomic_int ready;    // set by side 0 once everything below is initialised
+    atomic_int attached;
+    LinkQueue queue[2]; // queue[n] carries what side n sends
+} LinkChannel;
+
+typedef struct Link {
+    LinkChannel *channel;
+    int side;       // 0 or 1
+    uint8_t seq;    // sequence number of our current transfer
+    char name[80];
+} Link;
+
+extern bool link_open_shared(CPU *cpu, const char *name);
+extern void link_close(CPU *cpu);
+
+extern void link_send(Link *link, uint8_t type, uint8_t seq, uint8_t value);
+extern void link_poll(CPU *cpu);
+
+#endif
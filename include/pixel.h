@@ -0,0 +1,37 @@
+#ifndef PIXEL_H
+#define PIXEL_H
+
+#include <stdint.h>
+
+/* Pixel kernels used by the PPU.
+    Every kernel has a scalar version, SSE2/AVX2 on x86 and NEON on ARM.
+    pixel_init picks the widest one the cpu supports, until then the
+    scalar versions are used.
+
+    decode_2bpp:  tile rows as stored in VRAM (low plane, high plane) to
+                  8 colour ids per row
+    map_palette:  colour ids 0-3 to shades through BGP/OBP0/OBP1
+    to_argb:      shades (or any 0-3 index) to 32 bit pixels through a
+                  4 entry table
+*/
+
+typedef void (*pixel_decode_fn)(const uint8_t *planes, uint8_t *ids, int rows);
+typedef void (*pixel_palette_fn)(const uint8_t *ids, uint8_t *shades, uint8_t palette, int n);
+typedef void (*pixel_argb_fn)(const uint8_t *index, uint32_t *out, const uint32_t colours[4], int n);
+
+extern pixel_decode_fn pixel_decode_2bpp;
+extern pixel_palette_fn pixel_map_palette;
+extern pixel_argb_fn pixel_to_argb;
+
+extern void pixel_init(void);
+extern const char *pixel_kernel_name(void);
+
+// A single row (one VRAM write) is too little for the vector kernels to pay for the call
+static inline void pixel_decode_row(uint8_t lo, uint8_t hi, uint8_t ids[8]) {
+    for (int x = 0; x < 8; x++) {
+        uint8_t bit = 7 - x;
+        ids[x] = ((hi >> bit) & 1) << 1 | ((lo >> bit) & 1);
+    }
+}
+
+#endif
@@ -17,6 +17,7 @@ extern SDL_Texture* shell_texture;
 
 extern bool init_screen();
 extern void present_screen(PPU *ppu, CPU *cpu);
+extern void screen_invalidate(void);
 extern void destroy_screen(void);
 extern void init_audio(CPU *cpu);
 extern void destroy_audio();
@@ -0,0 +1,30 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "cpu.h"
+
+/* -renderthreads: the core only writes down what every line is drawn from,
+   a render thread draws whole frames out of that, split into slices of lines
+   across a few workers.
+
+   A frame's record is VRAM as it was at its first line, every VRAM write after that
+   (with the line it came before) and the LineState of every line. Lines with
+   mid-line register writes still go through the FIFO on the core, straight
+   into the record. The core fills one record while the render thread draws
+   the other, a frame finished while the render thread is still busy is dropped. */
+
+extern bool render_enabled;
+
+extern bool render_start(PPU *ppu, int threads);
+extern void render_stop(void);
+
+// Core side, called by the PPU
+extern void render_begin_frame(CPU *cpu);
+extern void render_log_vram(uint16_t addr, uint8_t value);
+extern void render_log_vram_block(uint16_t addr, const uint8_t *values, int len);
+extern uint8_t *render_fifo_line(uint8_t ly);
+extern void render_record_line(uint8_t ly, const LineState *line);
+extern bool render_end_frame(void);
+extern void render_blank_frame(void);
+
+#endif
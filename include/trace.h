@@ -0,0 +1,63 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Binary execution trace
+    Every executed instruction becomes one fixed-size TraceRecord.
+    Records are put into a lock-free ring on the core thread and a
+    background writer thread drains the ring into the trace file.
+    Nothing is formatted on the hot path, tools/trace_decode.c turns
+    the file back into text (or gameboy-doctor logs) afterwards.
+
+    File layout: TraceHeader, then TraceRecords until EOF.
+*/
+
+#define TRACE_MAGIC "ADMGTRC1"
+#define TRACE_VERSION 1
+
+#define TRACE_MAX_ACCESS 4          // bus accesses kept per instruction
+#define TRACE_RING_SIZE (1 << 16)   // records, must be a power of two
+
+#define TRACE_ACCESS_READ  0
+#define TRACE_ACCESS_WRITE 1
+
+struct CPU;
+typedef struct CPU CPU;
+
+typedef struct {
+    uint16_t addr;
+    uint8_t value;
+    uint8_t kind; // TRACE_ACCESS_READ or TRACE_ACCESS_WRITE
+} TraceAccess;
+
+typedef struct {
+    uint64_t cycle;     // T-cycles since power on, before the instruction ran
+    uint16_t pc, sp;
+    uint16_t af, bc, de, hl;
+    uint8_t pcmem[4];   // opcode and the three bytes after it
+    uint8_t ime;
+    uint8_t n_access;   // can be larger than TRACE_MAX_ACCESS, the extra ones are dropped
+    uint8_t rom_bank;
+    uint8_t pad[5];
+    TraceAccess access[TRACE_MAX_ACCESS];
+} TraceRecord;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} TraceHeader;
+
+_Static_assert(sizeof(TraceRecord) == 48, "TraceRecord must stay 48 bytes");
+
+extern bool trace_enabled;
+
+extern bool trace_open(const char *path);
+extern void trace_close(void);
+extern void trace_begin(CPU *cpu, uint8_t opcode);
+extern void trace_access(uint16_t addr, uint8_t value, uint8_t kind);
+extern void trace_commit(void);
+
+#endif
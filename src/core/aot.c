@@ -0,0 +1,77 @@
+#include "aot.h"
+#include "cpu.h"
+#include "emu.h"
+#include "trace.h"
+#include <stdio.h>
+#include <dlfcn.h>
+
+/* Loads the shared object written by tools/gb2c.c and hands cpu_step
+   over to it whenever pc sits at the start of a compiled block. */
+
+bool aot_enabled = false;
+
+static void *aot_handle = NULL;
+static aot_dispatch_fn aot_dispatch = NULL;
+
+bool aot_load(const char *path) {
+    aot_handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!aot_handle) {
+        printf("Error: Could not load %s: %s\n", path, dlerror());
+        return false;
+    }
+
+    const unsigned *version = dlsym(aot_handle, AOT_VERSION_SYMBOL);
+    const unsigned *cpu_size = dlsym(aot_handle, AOT_CPU_SIZE_SYMBOL);
+    const uint8_t *rom_id = dlsym(aot_handle, AOT_ROM_ID_SYMBOL);
+    aot_dispatch = (aot_dispatch_fn)dlsym(aot_handle, AOT_DISPATCH_SYMBOL);
+
+    if (!version || !cpu_size || !rom_id || !aot_dispatch) {
+        printf("Error: %s was not made by gb2c\n", path);
+        aot_unload();
+        return false;
+    }
+    // the blocks poke at CPU directly, an object built against another layout would corrupt it
+    if (*version != AOT_VERSION || *cpu_size != sizeof(CPU)) {
+        printf("Error: %s was compiled for another build of admge, run gb2c again\n", path);
+        aot_unload();
+        return false;
+    }
+    // the blocks are the code of one cartridge, anything else would run someone else's
+    uint8_t id[AOT_ROM_ID_SIZE];
+    if (!rom || rom_size < 0x150) {
+        printf("Error: %s needs its rom loaded first\n", path);
+        aot_unload();
+        return false;
+    }
+    aot_rom_id(rom, id);
+    if (memcmp(id, rom_id, AOT_ROM_ID_SIZE) != 0) {
+        printf("Error: %s was compiled from another rom, run gb2c on this one\n", path);
+        aot_unload();
+        return false;
+    }
+
+    aot_enabled = true;
+    printf("Loaded compiled rom %s\n", path);
+    return true;
+}
+
+void aot_unload(void) {
+    aot_enabled = false;
+    aot_dispatch = NULL;
+    if (aot_handle) {
+        dlclose(aot_handle);
+        aot_handle = NULL;
+    }
+}
+
+// Runs one compiled block if there is one for pc, false leaves it to the interpreter
+bool aot_run(CPU *cpu) {
+    // the bootrom isn't in the cartridge and traces want every access, both stay interpreted
+    if (cpu->pc > 0x7FFF || bootrom_flag || trace_enabled)
+        return false;
+    // same as AOT_LEAVE: the interpreter sits out HDMA and sees DMA bus conflicts
+    if (cpu->stall || cpu->dma_active)
+        return false;
+
+    return aot_dispatch(cpu, rom_bank(cpu, cpu->pc), cpu->pc);
+}
@@ -1,5 +1,6 @@
 #include "cpu.h"
 #include "emu.h"
+#include "audio_ring.h"
 #include <string.h>
 #include <math.h>
 
@@ -13,14 +14,26 @@ static const int DUTY_TABLE[4][8] = {
 
 static const int NOISE_TIMERS[8] = {8, 16, 32, 48, 64, 80, 96, 112};
 
+#define AUDIO_FRAME 70224 // T-cycles of audio made in one batch, a video frame
+#define FRAME_SEQ_PERIOD 8192 // T-cycles between frame sequencer steps, 512 Hz
+
 void apu_init(APU *apu) {
 
     memset(apu, 0, sizeof(APU));
-    atomic_init(&apu->write_pos, 0);
-    atomic_init(&apu->read_pos, 0);
-    apu->sample_counter = 0.0;
-    apu->frame_seq_clock = 0;
-    apu->frame_seq = 0;
+    blip_init(&apu->blip, CPU_FREQUENCY, SAMPLE_RATE);
+    // the CPU starts at total_cycles 0 right after this
+    apu->synced = 0;
+    apu->frame_end = AUDIO_FRAME;
+    apu->mix_left = apu->mix_right = 0;
+    apu->rate_adjust = 1.0;
+    apu->frames_dropped = 0;
+    apu->mix_dirty = false;
+
+    /* The capacitor loses 1 - 0.999958 of its charge every T-cycle on a
+       DMG, per sample that's the power of the T-cycles in one. Q15. */
+    apu->highpass = false;
+    apu->capacitor[0] = apu->capacitor[1] = 0;
+    apu->charge_factor = (int32_t)(pow(0.999958, (double)CPU_FREQUENCY / SAMPLE_RATE) * 32768.0 + 0.5);
 }
 
 static void ch1_trigger(APU *apu) {
@@ -135,129 +148,112 @@ static void ch4_trigger(APU *apu) {
     apu->ch4_timer = NOISE_TIMERS[divisor_code] << clock_shift;
 }
 
-static void apu_step_timers(APU *apu, int t_cycles) {
-    // Channel 1 (Pulse)
-    if (apu->ch1_enabled) {
-        apu->ch1_timer -= t_cycles;
-        if (apu->ch1_timer <= 0) {
-            uint16_t freq_data = ((apu->nr14 & 0x07) << 8) | apu->nr13;
-            int period = (2048 - freq_data) * 4;
-            apu->ch1_timer += period; // Reload timer
+// Only a change in what a channel puts out makes the mix go again
+static void set_output(APU *apu, int *out, int value) {
+    if (*out != value) {
+        *out = value;
+        apu->mix_dirty = true;
+    }
+}
 
-            apu->ch1_duty_pos = (apu->ch1_duty_pos + 1) % 8;
-            
-            // Get duty cycle output (0 or 1)
-            uint8_t duty_pattern = (apu->nr11 >> 6) & 0x03;
-            int duty_output = DUTY_TABLE[duty_pattern][apu->ch1_duty_pos];
-            
-            // Combine with envelope volume (0-15)
-            uint8_t dac_input = duty_output * apu->ch1_envelope_volume;
+// A channel's timer ran out: its waveform moves on a step
+static void ch1_clock(APU *apu) {
+    uint16_t freq_data = ((apu->nr14 & 0x07) << 8) | apu->nr13;
+    int period = (2048 - freq_data) * 4;
+    apu->ch1_timer += period; // Reload timer
 
-            // Convert to float (-1.0 to 1.0)
-            apu->ch1_dac_out = (dac_input / 7.5f) - 1.0f;
-        }
-    } else {
-        apu->ch1_dac_out = 0.0f;
-    }
+    apu->ch1_duty_pos = (apu->ch1_duty_pos + 1) % 8;
 
-    // Channel 2 (Pulse)
-    if (apu->ch2_enabled) {
-        apu->ch2_timer -= t_cycles;
-        if (apu->ch2_timer <= 0) {
-            uint16_t freq_data = ((apu->nr24 & 0x07) << 8) | apu->nr23;
-            int period = (2048 - freq_data) * 4;
-            apu->ch2_timer += period; // Reload timer
-            
-            apu->ch2_duty_pos = (apu->ch2_duty_pos + 1) % 8;
+    // Get duty cycle output (0 or 1)
+    uint8_t duty_pattern = (apu->nr11 >> 6) & 0x03;
+    int duty_output = DUTY_TABLE[duty_pattern][apu->ch1_duty_pos];
 
-            uint8_t duty_pattern = (apu->nr21 >> 6) & 0x03;
-            int duty_output = DUTY_TABLE[duty_pattern][apu->ch2_duty_pos];
-            
-            uint8_t dac_input = duty_output * apu->ch2_envelope_volume;
-            apu->ch2_dac_out = (dac_input / 7.5f) - 1.0f;
-        }
-    } else {
-        apu->ch2_dac_out = 0.0f;
-    }
-
-    // Channel 3 (Wave)
-    // Check if DAC is on (bit 7 of NR30)
-    if (apu->nr30 & 0x80) {
-        apu->ch3_timer -= t_cycles;
-        if (apu->ch3_timer <= 0) {
-            uint16_t freq_data = ((apu->nr34 & 0x07) << 8) | apu->nr33;
-            int period = (2048 - freq_data) * 2;
-            apu->ch3_timer += period;
-            
-            // Advance wave position (0-31)
-            apu->ch3_wave_pos = (apu->ch3_wave_pos + 1) % 32;
-            
-            // Get 4-bit sample from Wave RAM
-            uint8_t sample_byte = apu->waveform[apu->ch3_wave_pos / 2];
-            uint8_t sample_4bit = (apu->ch3_wave_pos % 2 == 0) 
-                                ? (sample_byte >> 4)   // High nibble
-                                : (sample_byte & 0x0F); // Low nibble
-            
-            // Apply volume shift (NR32)
-            uint8_t vol_code = (apu->nr32 >> 5) & 0x03;
-            if (vol_code == 1) sample_4bit >>= 0; // 100%
-            else if (vol_code == 2) sample_4bit >>= 1; // 50%
-            else if (vol_code == 3) sample_4bit >>= 2; // 25%
-            else sample_4bit = 0; // 0%
-            
-            apu->ch3_dac_out = (sample_4bit / 7.5f) - 1.0f;
-        }
-    } else {
-        apu->ch3_dac_out = 0.0f;
-    }
+    // Combine with envelope volume (0-15)
+    uint8_t dac_input = duty_output * apu->ch1_envelope_volume;
 
-    // Channel 4 (Noise)
-    if (apu->ch4_enabled) {
-        apu->ch4_timer -= t_cycles;
-        if (apu->ch4_timer <= 0) {
-            uint8_t clock_shift = apu->nr43 >> 4;
-            uint8_t divisor_code = apu->nr43 & 0x07;
-            
-            // Reload timer
-            apu->ch4_timer += NOISE_TIMERS[divisor_code] << clock_shift;
+    // The DAC centres it: -15 to 15
+    set_output(apu, &apu->ch1_dac_out, dac_input * 2 - 15);
+}
 
-            // Clock the LFSR
-            uint16_t lfsr = apu->ch4_lfsr;
-            uint8_t xor_bit = (lfsr & 1) ^ ((lfsr >> 1) & 1);
-            lfsr = (lfsr >> 1) | (xor_bit << 14);
+static void ch2_clock(APU *apu) {
+    uint16_t freq_data = ((apu->nr24 & 0x07) << 8) | apu->nr23;
+    int period = (2048 - freq_data) * 4;
+    apu->ch2_timer += period; // Reload timer
 
-            // Check for 7-bit "short mode"
-            if (apu->nr43 & 0x08) {
-                lfsr = (lfsr & 0xBF7F) | (xor_bit << 6);
-            }
-            apu->ch4_lfsr = lfsr;
-            
-            int duty_output = !(lfsr & 1); 
-            
-            uint8_t dac_input = duty_output * apu->ch4_envelope_volume;
-            apu->ch4_dac_out = (dac_input / 7.5f) - 1.0f;
-        }
-    } else {
-        apu->ch4_dac_out = 0.0f;
+    apu->ch2_duty_pos = (apu->ch2_duty_pos + 1) % 8;
+
+    uint8_t duty_pattern = (apu->nr21 >> 6) & 0x03;
+    int duty_output = DUTY_TABLE[duty_pattern][apu->ch2_duty_pos];
+
+    uint8_t dac_input = duty_output * apu->ch2_envelope_volume;
+    set_output(apu, &apu->ch2_dac_out, dac_input * 2 - 15);
+}
+
+static void ch3_clock(APU *apu) {
+    uint16_t freq_data = ((apu->nr34 & 0x07) << 8) | apu->nr33;
+    int period = (2048 - freq_data) * 2;
+    apu->ch3_timer += period;
+
+    // Advance wave position (0-31)
+    apu->ch3_wave_pos = (apu->ch3_wave_pos + 1) % 32;
+
+    // Get 4-bit sample from Wave RAM
+    uint8_t sample_byte = apu->waveform[apu->ch3_wave_pos / 2];
+    uint8_t sample_4bit = (apu->ch3_wave_pos % 2 == 0)
+                        ? (sample_byte >> 4)   // High nibble
+                        : (sample_byte & 0x0F); // Low nibble
+
+    // Apply volume shift (NR32)
+    uint8_t vol_code = (apu->nr32 >> 5) & 0x03;
+    if (vol_code == 1) sample_4bit >>= 0; // 100%
+    else if (vol_code == 2) sample_4bit >>= 1; // 50%
+    else if (vol_code == 3) sample_4bit >>= 2; // 25%
+    else sample_4bit = 0; // 0%
+
+    set_output(apu, &apu->ch3_dac_out, sample_4bit * 2 - 15);
+}
+
+static void ch4_clock(APU *apu) {
+    uint8_t clock_shift = apu->nr43 >> 4;
+    uint8_t divisor_code = apu->nr43 & 0x07;
+
+    // Reload timer
+    apu->ch4_timer += NOISE_TIMERS[divisor_code] << clock_shift;
+
+    // Clock the LFSR
+    uint16_t lfsr = apu->ch4_lfsr;
+    uint8_t xor_bit = (lfsr & 1) ^ ((lfsr >> 1) & 1);
+    lfsr = (lfsr >> 1) | (xor_bit << 14);
+
+    // Check for 7-bit "short mode"
+    if (apu->nr43 & 0x08) {
+        lfsr = (lfsr & 0xBF7F) | (xor_bit << 6);
     }
+    apu->ch4_lfsr = lfsr;
+
+    int duty_output = !(lfsr & 1);
+
+    uint8_t dac_input = duty_output * apu->ch4_envelope_volume;
+    set_output(apu, &apu->ch4_dac_out, dac_input * 2 - 15);
 }
 
-static int16_t generate_mixed_sample(APU *apu) {
-    // What I'm supposed to do
-    // 1. Step all 4 channels (timers, envelopes, sweep)
-    // 2. Get the current amplitude from each enabled channel
-    // 3. Mix them together (simple addition)
-    // 4. Return the final 16-bit sample.
+/* The levels the four channels add up to right now on each side, blip turns
+   their changes into samples. All integer: a DAC is -15 to 15 and NR50's
+   volume 0-7, one channel at full volume comes out at MIX_SCALE, four of
+   them still fit in 16 bits. */
+#define MIX_SCALE 8000
 
+static void mix_levels(APU *apu, int *left, int *right) {
+    *left = *right = 0;
     // If master APU switch is off, return silence
-    if ((apu->nr52 & 0x80) == 0 || SDL_AtomicGet(&muted) != 0) {
-        return 0;
+    if ((apu->nr52 & 0x80) == 0) {
+        return;
     }
 
-    float left_mix = 0.0f;
-    float right_mix = 0.0f;
+    int left_mix = 0;
+    int right_mix = 0;
 
-    // (apu->nr52 & 0x0X) checks if channel is enabled
+    // (apu->nr52 & 0x0X) checks if channel is enabled, NR51 pans it
     if (apu->nr52 & 0x01) {
         if (apu->nr51 & 0x10) left_mix += apu->ch1_dac_out;
         if (apu->nr51 & 0x01) right_mix += apu->ch1_dac_out;
@@ -275,17 +271,11 @@ static int16_t generate_mixed_sample(APU *apu) {
         if (apu->nr51 & 0x08) right_mix += apu->ch4_dac_out;
     }
 
-    float left_vol = ((apu->nr50 >> 4) & 0x07) / 7.0f;
-    float right_vol = (apu->nr50 & 0x07) / 7.0f;
+    int left_vol = (apu->nr50 >> 4) & 0x07;
+    int right_vol = apu->nr50 & 0x07;
 
-    float final_left = left_mix * left_vol;
-    float final_right = right_mix * right_vol;
-    
-    float mono_mix = (final_left + final_right) / 2.0f;
-
-    int16_t sample = (int16_t)(mono_mix * 8000.0f); 
-
-    return sample;
+    *left = left_mix * left_vol * MIX_SCALE / (15 * 7);
+    *right = right_mix * right_vol * MIX_SCALE / (15 * 7);
 }
 
 // In apu.c, add these new functions:
@@ -442,6 +432,9 @@ static void apu_step_frame_sequencer(APU *apu, uint8_t step) {
     // Step 6: Length, Sweep
     // Step 7: Envelope
 
+    // lengths and envelopes change the mix without a channel's timer running out
+    apu->mix_dirty = true;
+
     if (step % 2 == 0) { // Steps 0, 2, 4, 6
         apu_step_length(apu);
     }
@@ -454,56 +447,123 @@ static void apu_step_frame_sequencer(APU *apu, uint8_t step) {
 }
 
 
-/**
- * This is the "Producer" function.
- * It's called by the main emulator loop (cpu_step).
- * It's job is to generate samples based on CPU cycles
- * and push them into the ring buffer.
- */
-void apu_step(APU *apu, CPU *cpu) {
-
-    int t_cycles = cpu->cycles * 4;
-
-    apu->sample_counter += t_cycles;
-
-    apu->frame_seq_clock += t_cycles;
-    if (apu->frame_seq_clock >= 8192) {
-        apu->frame_seq_clock -= 8192;
-        apu_step_frame_sequencer(apu, apu->frame_seq);
-        apu->frame_seq = (apu->frame_seq + 1) % 8;
+/* The output capacitor: what's left after it is the input minus the charge
+   it holds, and the charge follows the input. Takes the DC offset out,
+   the DACs are never centred when channels are off or quiet. */
+static void high_pass(APU *apu, int16_t *frames, int count) {
+    for (int i = 0; i < count * 2; i++) {
+        int32_t *capacitor = &apu->capacitor[i & 1]; // Q15 like the factor
+        int32_t in = frames[i];
+        int32_t out = in - (*capacitor >> 15);
+        *capacitor = (int32_t)(((int64_t)in << 15) - (int64_t)out * apu->charge_factor);
+        if (out > INT16_MAX) out = INT16_MAX;
+        if (out < INT16_MIN) out = INT16_MIN;
+        frames[i] = (int16_t)out;
     }
+}
 
-    if ((apu->nr52 & 0x80)) { // Only step timers if APU is on
-        apu_step_timers(apu, t_cycles);
-    }
+// A frame's worth of audio is done: integrate it into L/R frames and hand them to the ring
+static void end_audio_frame(APU *apu) {
+    static int16_t frames[BLIP_MAX_SAMPLES * 2];
+
+    blip_end_frame(&apu->blip, AUDIO_FRAME);
+    apu->frame_end += AUDIO_FRAME;
+    blip_set_rates(&apu->blip, CPU_FREQUENCY, SAMPLE_RATE * apu->rate_adjust);
+    int count = blip_read_samples(&apu->blip, frames, BLIP_MAX_SAMPLES);
+    if (apu->highpass)
+        high_pass(apu, frames, count);
+    // still read while muted, the deltas have to go somewhere
+    if (SDL_AtomicGet(&muted) != 0)
+        memset(frames, 0, count * 2 * sizeof(int16_t));
+
+    // what doesn't fit is dropped, the core didn't leave AUDIO_RING_BATCH free
+    apu->frames_dropped += count - audio_ring_write(&audio_ring, frames, count);
+}
 
-    // Only generate a new cycle if enough cycles have passed
-    while (apu->sample_counter >= CYCLES_PER_SAMPLE) {
-        apu->sample_counter -= CYCLES_PER_SAMPLE;
+// If the mix changed, blip gets the difference at time (T-cycles into the audio frame)
+static void mix_changes(APU *apu, uint32_t time) {
+    if (!apu->mix_dirty)
+        return;
+    int left, right;
+    mix_levels(apu, &left, &right);
+    if (left != apu->mix_left || right != apu->mix_right) {
+        blip_add_delta(&apu->blip, time, left - apu->mix_left, right - apu->mix_right);
+        apu->mix_left = left;
+        apu->mix_right = right;
+    }
+    apu->mix_dirty = false;
+}
 
-        int16_t mono_sample = generate_mixed_sample(apu);
+/* The channels run for cycles T-cycles from synced. Between two timers
+   running out nothing happens, so it jumps from one to the next, and every
+   change in the mix reaches blip at the cycle it happened on. */
+static void run_channels(APU *apu, int cycles) {
+    uint32_t time = (uint32_t)(apu->synced - (apu->frame_end - AUDIO_FRAME));
 
-        int write_pos = atomic_load(&apu->write_pos);
-        int read_pos = atomic_load(&apu->read_pos);
+    // a channel that isn't running puts out nothing
+    if (!apu->ch1_enabled) set_output(apu, &apu->ch1_dac_out, 0);
+    if (!apu->ch2_enabled) set_output(apu, &apu->ch2_dac_out, 0);
+    if (!(apu->nr30 & 0x80)) set_output(apu, &apu->ch3_dac_out, 0);
+    if (!apu->ch4_enabled) set_output(apu, &apu->ch4_dac_out, 0);
+    mix_changes(apu, time);
 
-        int next_write_pos = (write_pos + 2) % AUDIO_BUFFER_SIZE;
+    if ((apu->nr52 & 0x80) == 0) // Only step timers if APU is on
+        return;
 
-        if (next_write_pos == read_pos) {
-            // buffer got too full :(
-            // fatass
-            break; 
-        }
+    // only a register write or the frame sequencer stop a channel, neither happens in here
+    bool ch1 = apu->ch1_enabled;
+    bool ch2 = apu->ch2_enabled;
+    bool ch3 = apu->nr30 & 0x80; // ch3 goes by its DAC
+    bool ch4 = apu->ch4_enabled;
+
+    while (cycles > 0) {
+        int step = cycles;
+        if (ch1 && apu->ch1_timer < step) step = apu->ch1_timer;
+        if (ch2 && apu->ch2_timer < step) step = apu->ch2_timer;
+        if (ch3 && apu->ch3_timer < step) step = apu->ch3_timer;
+        if (ch4 && apu->ch4_timer < step) step = apu->ch4_timer;
+        if (step < 0)
+            step = 0;
+        cycles -= step;
+        time += step;
+
+        if (ch1 && (apu->ch1_timer -= step) <= 0) ch1_clock(apu);
+        if (ch2 && (apu->ch2_timer -= step) <= 0) ch2_clock(apu);
+        if (ch3 && (apu->ch3_timer -= step) <= 0) ch3_clock(apu);
+        if (ch4 && (apu->ch4_timer -= step) <= 0) ch4_clock(apu);
+        mix_changes(apu, time);
+    }
+}
 
-        // Apparently we just duplicate the mono sample for stereo
-        apu->internal_buffer[write_pos] = mono_sample; // Left Channel
-        apu->internal_buffer[(write_pos + 1) % AUDIO_BUFFER_SIZE] = mono_sample; // Right Channel
-        
-        atomic_store(&apu->write_pos, next_write_pos);
+/**
+ * This is the "Producer" function.
+ * The APU isn't stepped with the CPU, it catches up from synced to now
+ * whenever its state matters: a read or write of its registers (apu_read,
+ * apu_write) and the end of an audio frame, which step_hardware checks for.
+ * The frame sequencer steps at every multiple of FRAME_SEQ_PERIOD since
+ * power on, the catch-up stops on those and on the end of the audio frame.
+ */
+void apu_sync(APU *apu, uint64_t now) {
+    while (apu->synced < now) {
+        uint64_t until = (apu->synced / FRAME_SEQ_PERIOD + 1) * FRAME_SEQ_PERIOD;
+        if (apu->frame_end < until)
+            until = apu->frame_end;
+        if (now < until)
+            until = now;
+
+        run_channels(apu, (int)(until - apu->synced));
+        apu->synced = until;
+
+        if (until % FRAME_SEQ_PERIOD == 0)
+            apu_step_frame_sequencer(apu, (until / FRAME_SEQ_PERIOD - 1) % 8);
+        if (until == apu->frame_end)
+            end_audio_frame(apu);
     }
 }
 
 uint8_t apu_read(CPU *cpu, uint16_t addr) {
     APU *apu = &cpu->apu;
+    apu_sync(apu, cpu->total_cycles);
 
     // NR52 (0xFF26) is always readable
     if (addr == 0xFF26) {
@@ -562,6 +622,9 @@ uint8_t apu_read(CPU *cpu, uint16_t addr) {
 void apu_write(CPU *cpu, uint16_t addr, uint8_t value) {
 
     APU *apu = &cpu->apu;
+    apu_sync(apu, cpu->total_cycles);
+    // panning, master volume, triggers and the power switch all go into the mix
+    apu->mix_dirty = true;
     if (addr == 0xFF26) {
         apu->nr52 = (value & 0x80) | (apu->nr52 & 0x0F);
         
@@ -0,0 +1,52 @@
+#include "audio_ring.h"
+#include <string.h>
+
+AudioRing audio_ring;
+
+// count frames from index on, in at most two runs: up to the end of the ring, then from its start
+static void copy_in(AudioRing *ring, size_t index, const int16_t *frames, size_t count) {
+    size_t slot = index & (AUDIO_RING_FRAMES - 1);
+    size_t first = AUDIO_RING_FRAMES - slot;
+    if (first > count)
+        first = count;
+    memcpy(&ring->samples[slot * 2], frames, first * 2 * sizeof(int16_t));
+    memcpy(ring->samples, &frames[first * 2], (count - first) * 2 * sizeof(int16_t));
+}
+
+static void copy_out(const AudioRing *ring, size_t index, int16_t *frames, size_t count) {
+    size_t slot = index & (AUDIO_RING_FRAMES - 1);
+    size_t first = AUDIO_RING_FRAMES - slot;
+    if (first > count)
+        first = count;
+    memcpy(frames, &ring->samples[slot * 2], first * 2 * sizeof(int16_t));
+    memcpy(&frames[first * 2], ring->samples, (count - first) * 2 * sizeof(int16_t));
+}
+
+size_t audio_ring_write(AudioRing *ring, const int16_t *frames, size_t count) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t space = AUDIO_RING_FRAMES - (head - tail);
+    if (count > space)
+        count = space;
+
+    copy_in(ring, head, frames, count);
+    atomic_store_explicit(&ring->head, head + count, memory_order_release);
+    return count;
+}
+
+size_t audio_ring_read(AudioRing *ring, int16_t *frames, size_t count) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (count > head - tail)
+        count = head - tail;
+
+    copy_out(ring, tail, frames, count);
+    atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+    return count;
+}
+
+size_t audio_ring_fill(AudioRing *ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    return head - tail;
+}
@@ -0,0 +1,110 @@
+#include "blip.h"
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#define DELTA_BITS 15 // a kernel adds up to 1 << DELTA_BITS
+#define PHASE_BITS 5  // BLIP_PHASES is 1 << PHASE_BITS
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* kernel[phase] is the impulse a delta leaves on the 16 samples from the one
+   it lands in, phase/32 of the way into that sample. Blackman windowed sinc,
+   cut off a little under Nyquist. Every phase sums to exactly 1 << DELTA_BITS,
+   so the integrated output never drifts. */
+static int16_t kernel[BLIP_PHASES][BLIP_WIDTH];
+static bool kernel_ready = false;
+
+static void build_kernel(void) {
+    const double cutoff = 0.9; // of Nyquist
+    const double half = BLIP_WIDTH / 2;
+
+    for (int phase = 0; phase < BLIP_PHASES; phase++) {
+        double taps[BLIP_WIDTH], sum = 0;
+        for (int i = 0; i < BLIP_WIDTH; i++) {
+            // distance from the step, the step sits half the kernel in
+            double x = i - (half - 1) - (double)phase / BLIP_PHASES;
+            double sinc = (x == 0) ? cutoff : sin(M_PI * cutoff * x) / (M_PI * x);
+            double w = (x + half) / BLIP_WIDTH;
+            double window = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+            taps[i] = sinc * window;
+            sum += taps[i];
+        }
+
+        int total = 0, peak = 0;
+        for (int i = 0; i < BLIP_WIDTH; i++) {
+            kernel[phase][i] = (int16_t)lround(taps[i] / sum * (1 << DELTA_BITS));
+            total += kernel[phase][i];
+            if (kernel[phase][i] > kernel[phase][peak])
+                peak = i;
+        }
+        // rounding leftovers go on the biggest tap
+        kernel[phase][peak] += (1 << DELTA_BITS) - total;
+    }
+    kernel_ready = true;
+}
+
+void blip_init(Blip *blip, double clock_rate, double sample_rate) {
+    if (!kernel_ready)
+        build_kernel();
+    memset(blip, 0, sizeof(*blip));
+    blip_set_rates(blip, clock_rate, sample_rate);
+}
+
+void blip_set_rates(Blip *blip, double clock_rate, double sample_rate) {
+    blip->factor = (uint64_t)(sample_rate / clock_rate * 4294967296.0 + 0.5);
+}
+
+void blip_add_delta(Blip *blip, uint32_t time, int left, int right) {
+    uint64_t fixed = time * blip->factor + blip->offset;
+    uint32_t index = blip->avail + (uint32_t)(fixed >> 32);
+    // a frame longer than the buffer, only if nobody ends them
+    if (index >= BLIP_MAX_SAMPLES)
+        return;
+
+    const int16_t *k = kernel[(fixed >> (32 - PHASE_BITS)) & (BLIP_PHASES - 1)];
+    int32_t *out = &blip->buffer[index * 2];
+    for (int i = 0; i < BLIP_WIDTH; i++) {
+        out[i * 2] += k[i] * left;
+        out[i * 2 + 1] += k[i] * right;
+    }
+}
+
+// The frame is over after clocks, its samples can be read and time starts over
+void blip_end_frame(Blip *blip, uint32_t clocks) {
+    uint64_t end = clocks * blip->factor + blip->offset;
+    blip->avail += (int)(end >> 32);
+    if (blip->avail > BLIP_MAX_SAMPLES)
+        blip->avail = BLIP_MAX_SAMPLES;
+    blip->offset = end & 0xFFFFFFFF;
+}
+
+static int16_t clamp16(int32_t sample) {
+    if (sample > INT16_MAX) return INT16_MAX;
+    if (sample < INT16_MIN) return INT16_MIN;
+    return (int16_t)sample;
+}
+
+int blip_read_samples(Blip *blip, int16_t *out, int count) {
+    if (count > blip->avail)
+        count = blip->avail;
+
+    int32_t left = blip->integrator[0], right = blip->integrator[1];
+    for (int i = 0; i < count; i++) {
+        left += blip->buffer[i * 2];
+        right += blip->buffer[i * 2 + 1];
+        out[i * 2] = clamp16(left >> DELTA_BITS);
+        out[i * 2 + 1] = clamp16(right >> DELTA_BITS);
+    }
+    blip->integrator[0] = left;
+    blip->integrator[1] = right;
+
+    // the kernel tails of the last deltas reach past avail, they move along
+    int left_over = blip->avail - count + BLIP_WIDTH;
+    memmove(blip->buffer, &blip->buffer[count * 2], left_over * 2 * sizeof(int32_t));
+    memset(&blip->buffer[left_over * 2], 0, count * 2 * sizeof(int32_t));
+    blip->avail -= count;
+    return count;
+}
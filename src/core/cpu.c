@@ -1,5 +1,7 @@
 #include "cpu.h"
 #include "emu.h"
+#include "trace.h"
+#include "aot.h"
 #include <time.h>
 // initializes emu state
 void start_cpu(CPU *cpu) {
@@ -64,7 +66,24 @@ void start_cpu(CPU *cpu) {
 
     cpu->joypad = 0xFF;
 
+    cpu->link = NULL;
+    cpu->serial_cycles = 0;
+    cpu->serial_reply = false;
+
+    cpu->dma_reg = 0x00;
+    cpu->dma_active = false;
+    cpu->dma_starting = false;
+
+    // CGB, set up for real by load_rom
+    cpu->double_speed = false;
+    cpu->key1 = 0;
+    cpu->svbk = 1;
+    cpu->hdma_active = false;
+    cpu->hdma_blocks = 0;
+    cpu->stall = 0;
+
     cpu->cycles = 0;
+    cpu->total_cycles = 0;
 }
 
 /* Starting without a Bootrom, keeps expected 
@@ -132,7 +151,25 @@ void start_cpu_noboot(CPU *cpu) {
 
     cpu->joypad = 0xFF;
 
+    cpu->link = NULL;
+    cpu->serial_cycles = 0;
+    cpu->serial_reply = false;
+
+    // what the boot rom leaves in $FF46
+    cpu->dma_reg = 0xFF;
+    cpu->dma_active = false;
+    cpu->dma_starting = false;
+
+    // CGB, set up for real by load_rom
+    cpu->double_speed = false;
+    cpu->key1 = 0;
+    cpu->svbk = 1;
+    cpu->hdma_active = false;
+    cpu->hdma_blocks = 0;
+    cpu->stall = 0;
+
     cpu->cycles = 0;
+    cpu->total_cycles = 0;
 }
 
 bool handle_interrupts(CPU *cpu) {
@@ -284,6 +321,35 @@ void update_rtc(CPU *cpu) {
     cpu->rtc.main[2] &= 0x1F;
 }
 
+// Everything that runs next to the CPU catches up on the cycles of the last step
+static void step_hardware(CPU *cpu) {
+    int tcycles = cpu->cycles * 4;
+    // the timers and serial go twice as fast with the CPU in double speed, the PPU and APU don't
+    int dots = cpu->double_speed ? tcycles / 2 : tcycles;
+    if (cpu->dma_active)
+        dma_step(cpu, cpu->cycles);
+    ppu_step(&cpu->ppu, cpu, dots);
+    update_timers(cpu, tcycles);
+    if (cpu->link || cpu->serial_cycles)
+        serial_step(cpu, tcycles);
+    cpu->total_cycles += dots;
+    // the APU catches up by itself when it's touched, here only to finish audio frames
+    if (cpu->total_cycles >= cpu->apu.frame_end)
+        apu_sync(&cpu->apu, cpu->total_cycles);
+    cpu->cycles = 0;
+}
+
+/* End of an instruction: a pending EI takes effect and the hardware
+   catches up. Compiled blocks (aot.h) call this after every instruction. */
+void cpu_retire(CPU *cpu, bool pending_ei) {
+    if (pending_ei) {
+        //printf("ime_enable hit true. Enabling ime now\n");
+        cpu->ime = true;
+        cpu->ime_enable = false;
+    }
+    step_hardware(cpu);
+}
+
 /* Basically the main function that drives the emu. In every step, fetch opcode
     1. Fetch opcode from memory
     2. Execute the instruction 
@@ -292,11 +358,17 @@ void update_rtc(CPU *cpu) {
 */
 void cpu_step(CPU *cpu){
 
+    // CGB HDMA holds the CPU up, everything else goes on. In small steps,
+    // the PPU only moves one mode on per step
+    if (cpu->stall) {
+        cpu->cycles = cpu->stall < 4 ? cpu->stall : 4;
+        cpu->stall -= cpu->cycles;
+        step_hardware(cpu);
+        return;
+    }
+
     if(handle_interrupts(cpu)){
-        ppu_step(&cpu->ppu, cpu);
-        apu_step(&cpu->apu, cpu);
-        update_timers(cpu, cpu->cycles * 4);
-        cpu->cycles = 0;
+        step_hardware(cpu);
         return; 
     }
     
@@ -305,40 +377,21 @@ void cpu_step(CPU *cpu){
     if (cpu->halted) {
         //printf("The CPU was halted!\n\n");
         cpu->cycles = 1; // 1 M-Cycle (4 T-Cycles)
-        ppu_step(&cpu->ppu, cpu);
-        apu_step(&cpu->apu, cpu);
-        update_timers(cpu, cpu->cycles * 4);
-        cpu->cycles = 0;
+        step_hardware(cpu);
         return;
     }
 
+    if (aot_enabled && aot_run(cpu))
+        return;
+
     //printf("Starting a step.\n");
     uint8_t opcode = read8(cpu, cpu->pc);
     //printf("Current op: %02x \n", opcode);
-/* 
-    if (cpu->pc == 0x0100 && !enable_logging) {
-        enable_logging = true;
-    }
-
-    if (enable_logging && log_file) {
-        fprintf(log_file, 
-            "PC:%04X OP:%02X | AF:%04X BC:%04X DE:%04X HL:%04X SP:%04X\n", 
-            cpu->pc, opcode, 
-            cpu->regs.af, cpu->regs.bc, cpu->regs.de, cpu->regs.hl, cpu->sp);
-    } */
+    if (trace_enabled) trace_begin(cpu, opcode);
     run_inst(opcode, cpu);
+    if (trace_enabled) trace_commit();
     //printf("pc post inst %02x \n\n", cpu->pc);
-    if (pending_ei) {
-        //printf("ime_enable hit true. Enabling ime now\n");
-        cpu->ime = true;
-        cpu->ime_enable = false;
-    }
-
-
-    ppu_step(&cpu->ppu, cpu);
-    apu_step(&cpu->apu, cpu);
-    update_timers(cpu, cpu->cycles*4);
-    cpu->cycles = 0;
+    cpu_retire(cpu, pending_ei);
 }
 
 // Change Z based on result <- NOTE this is the exact opposite of all other flag functions
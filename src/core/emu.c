@@ -0,0 +1,38 @@
+#include "emu.h"
+#include "cpu.h"
+
+/* Emulator wide state shared by the frontend (main.c) and the tools
+   that link the core (test runner). */
+
+SDL_atomic_t quit_flag = {0};
+SDL_atomic_t muted = {0};
+SDL_atomic_t rom_loaded = {0};
+
+float win_scale = 0.7;
+bool bootrom_flag = true;
+bool cgb_flag = true; // CGB cartridges run in CGB mode, -dmg turns that off
+bool drc_flag = false; // -drc: frames are paced by the clock, the audio rate follows the ring
+char* inputRom;
+char serial_log[65536];  
+size_t serial_len = 0;
+uint8_t *rom = NULL;
+size_t rom_size = 0;
+bool enable_logging;
+FILE *log_file;
+
+// Palettes
+_Atomic(const uint32_t *) GAMEBOY_COLOURS = NULL;
+const uint32_t MGB_COLOURS[4] = {
+    0xFFFFFFFF, // White
+    0xFFAAAAAA, // Light Gray
+    0xFF555555, // Dark Gray
+    0xFF000000  // Black
+};
+const uint32_t DMG_COLOURS[4] = {
+    0xFF9BBC0F, // Lightest Green
+    0xFF8BAC0F, // Light GreenT
+    0xFF306230, // Dark Green
+    0xFF0F380F  // Darkest Green
+};
+
+emu_mode current_mode = DMG;
@@ -0,0 +1,172 @@
+#define _POSIX_C_SOURCE 200809L
+#include "link.h"
+#include "cpu.h"
+#include "emu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static bool queue_push(LinkQueue *q, uint32_t msg) {
+    unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head - tail >= LINK_QUEUE_SIZE)
+        return false;
+    q->messages[head & (LINK_QUEUE_SIZE - 1)] = msg;
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return true;
+}
+
+static bool queue_pop(LinkQueue *q, uint32_t *msg) {
+    unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (head == tail)
+        return false;
+    *msg = q->messages[tail & (LINK_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static void queue_reset(LinkQueue *q) {
+    atomic_store(&q->head, 0);
+    atomic_store(&q->tail, 0);
+}
+
+void link_send(Link *link, uint8_t type, uint8_t seq, uint8_t value) {
+    uint32_t msg = ((uint32_t)type << 16) | ((uint32_t)seq << 8) | value;
+    // a full queue means the other side stopped listening, the byte is lost like on a pulled cable
+    queue_push(&link->channel->queue[link->side], msg);
+}
+
+/* Handles whatever the other side sent since the last step.
+   LINK_DATA: the other side is the master and clocked a byte out.
+              We always answer with SB, but only take the byte if we
+              have an external clock transfer waiting.
+   LINK_REPLY: the answer to our own transfer. */
+void link_poll(CPU *cpu) {
+    Link *link = cpu->link;
+    uint32_t msg;
+
+    while (queue_pop(&link->channel->queue[link->side ^ 1], &msg)) {
+        uint8_t type = (msg >> 16) & 0xFF;
+        uint8_t seq = (msg >> 8) & 0xFF;
+        uint8_t value = msg & 0xFF;
+
+        if (type == LINK_DATA) {
+            link_send(link, LINK_REPLY, seq, cpu->memory[0xFF01]);
+            if ((cpu->memory[0xFF02] & 0x81) == 0x80)
+                serial_complete(cpu, value);
+        }
+        else if (type == LINK_REPLY && seq == link->seq) {
+            // stale answers to transfers that already timed out are dropped
+            cpu->serial_in = value;
+            cpu->serial_reply = true;
+        }
+    }
+}
+
+static Link *link_new(LinkChannel *channel, int side, const char *name) {
+    Link *link = calloc(1, sizeof(Link));
+    if (!link) return NULL;
+    link->channel = channel;
+    link->side = side;
+    snprintf(link->name, sizeof(link->name), "%s", name);
+    return link;
+}
+
+/* Both processes call this with the same name. Whoever creates the segment
+   is side 0: it sets the queues up before anyone can attach, the other side
+   waits for the segment to have its size and for ready before touching it. */
+bool link_open_shared(CPU *cpu, const char *name) {
+    char path[80];
+    snprintf(path, sizeof(path), "/admge-%s", name);
+
+    int fd = shm_open(path, O_CREAT | O_EXCL | O_RDWR, 0600);
+    bool creator = (fd >= 0);
+    if (!creator && errno == EEXIST)
+        fd = shm_open(path, O_RDWR, 0600);
+    if (fd < 0) {
+        printf("Error: Could not open link %s\n", path);
+        return false;
+    }
+
+    if (creator && ftruncate(fd, sizeof(LinkChannel)) != 0) {
+        printf("Error: Could not size link %s\n", path);
+        close(fd);
+        shm_unlink(path);
+        return false;
+    }
+    // between shm_open and ftruncate the creator's segment is still empty
+    struct stat st;
+    uint32_t start = SDL_GetTicks();
+    while (!creator && (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(LinkChannel))) {
+        if (SDL_GetTicks() - start >= LINK_JOIN_MS) {
+            printf("Error: Link %s never got set up (remove /dev/shm%s if it is stale)\n", path, path);
+            close(fd);
+            return false;
+        }
+        SDL_Delay(1);
+    }
+
+    LinkChannel *channel = mmap(NULL, sizeof(LinkChannel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (channel == MAP_FAILED) {
+        printf("Error: Could not map link %s\n", path);
+        if (creator) shm_unlink(path);
+        return false;
+    }
+
+    int side;
+    if (creator) {
+        queue_reset(&channel->queue[0]);
+        queue_reset(&channel->queue[1]);
+        atomic_store(&channel->attached, 1);
+        atomic_store_explicit(&channel->ready, 1, memory_order_release);
+        side = 0;
+    }
+    else {
+        start = SDL_GetTicks();
+        while (!atomic_load_explicit(&channel->ready, memory_order_acquire)) {
+            if (SDL_GetTicks() - start >= LINK_JOIN_MS) {
+                printf("Error: Link %s never got set up (remove /dev/shm%s if it is stale)\n", path, path);
+                munmap(channel, sizeof(LinkChannel));
+                return false;
+            }
+            SDL_Delay(1);
+        }
+        side = atomic_fetch_add(&channel->attached, 1);
+        if (side != 1) {
+            atomic_fetch_sub(&channel->attached, 1);
+            munmap(channel, sizeof(LinkChannel));
+            if (side == 0)
+                printf("Error: Link %s was just closed by the other player\n", path);
+            else
+                printf("Error: Link %s already has two players (remove /dev/shm%s if it is stale)\n", path, path);
+            return false;
+        }
+    }
+
+    cpu->link = link_new(channel, side, path);
+    if (!cpu->link) {
+        if (atomic_fetch_sub(&channel->attached, 1) == 1)
+            shm_unlink(path);
+        munmap(channel, sizeof(LinkChannel));
+        return false;
+    }
+    printf("Link %s connected as player %d\n", path, side + 1);
+    return true;
+}
+
+void link_close(CPU *cpu) {
+    Link *link = cpu->link;
+    if (!link) return;
+
+    bool last = atomic_fetch_sub(&link->channel->attached, 1) == 1;
+    munmap(link->channel, sizeof(LinkChannel));
+    if (last) shm_unlink(link->name);
+    free(link);
+    cpu->link = NULL;
+}
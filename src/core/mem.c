@@ -1,5 +1,7 @@
 #include "emu.h"
 #include "cpu.h"
+#include "trace.h"
+#include "aot.h"
 #include <stdio.h>
 #include <string.h>
 
@@ -9,6 +11,36 @@ void serial_write(uint8_t value) {
     }
 }
 
+/* CGB cartridges (header $143 bit 7) start in colour mode unless -dmg.
+   The only boot ROM we run is the DMG one, so it gets skipped and the state
+   the CGB boot ROM leaves behind is set up instead. */
+static void cgb_start(CPU *cpu) {
+    if (bootrom_flag) {
+        // start_cpu_noboot would also throw away the PPU options main has set by now
+        bootrom_flag = false;
+        cpu->pc = 0x0100;
+        cpu->sp = 0xFFFE;
+        cpu->ppu.lcdc = 0x91;
+        cpu->div = cpu->memory[0xFF04] = 0xAB;
+        cpu->dma_reg = 0xFF;
+    }
+    cpu->regs.af = 0x1180;
+    cpu->regs.bc = 0x0000;
+    cpu->regs.de = 0xFF56;
+    cpu->regs.hl = 0x000D;
+
+    cpu->double_speed = false;
+    cpu->key1 = 0;
+    cpu->svbk = 1;
+    memset(cpu->wram, 0, sizeof(cpu->wram));
+    cpu->hdma_src = cpu->hdma_dst = 0;
+    cpu->hdma_blocks = 0;
+    cpu->hdma_active = false;
+    cpu->stall = 0;
+    ppu_cgb_init(&cpu->ppu);
+    printf("CGB mode\n");
+}
+
 bool load_rom(CPU *cpu, const char* filename) {    
     FILE* romFile = fopen(filename, "rb");
     if (!romFile) {
@@ -34,16 +66,54 @@ bool load_rom(CPU *cpu, const char* filename) {
         return false;
     }
     fclose(romFile);
+
+    // a compiled object belongs to the rom it was loaded for, not to one opened from the UI
+    if (aot_enabled) {
+        printf("Another rom was loaded, running it without the compiled object\n");
+        aot_unload();
+    }
     
     memcpy(cpu->memory, rom, rom_size > 0x8000 ? 0x8000 : rom_size);
     printf("Successfully loaded ROM. Size: %zu bytes\n", rom_size);
     cpu->mbc_type = rom[0x0147];
     printf("Cartridge Type: 0x%02X\n", cpu->mbc_type);
+    if (cgb_flag && rom_size > 0x0143 && (rom[0x0143] & 0x80))
+        cgb_start(cpu);
     load_sav(cpu, filename);
     return true;
 }
 
-uint8_t read8(CPU *cpu, uint16_t addr) {
+// The rom bank the cpu currently sees at addr (0x0000-0x7FFF)
+uint32_t rom_bank(CPU *cpu, uint16_t addr) {
+    // Bank 00 is fixed
+    if (addr <= 0x3FFF) {
+        if ((cpu->mbc_type >= 0x01 && cpu->mbc_type <= 0x03) && cpu->bank_mode == 1) {
+            return cpu->curr_ram_bank << 5;
+        }
+        return 0;
+    }
+
+    // 0x4000-0x7FFF --> switchable banks
+    uint32_t bank = cpu->curr_rom_bank;
+    //mbc1
+    if(cpu->mbc_type >= 0x01 && cpu->mbc_type <= 0x03){
+        uint32_t low = bank & 0x1F;
+        if(low == 0) low = 1;
+        bank = ((cpu->curr_ram_bank & 0x03) << 5) | low;
+    }
+    //mbc3
+    else if(cpu->mbc_type >= 0x0F && cpu->mbc_type <= 0x13){
+        bank &= 0x7F;
+        if(bank == 0) bank = 1;
+    }
+    //mbc5
+    else if (cpu->mbc_type >= 0x19 && cpu->mbc_type <= 0x1E) {
+        bank = cpu->curr_rom_bank & 0x1FF;
+    }
+    return bank;
+}
+
+static uint8_t bus_read(CPU *cpu, uint16_t addr) {
 
     if (bootrom_flag && addr < 0x0100) {
         return cpu->bootrom[addr];
@@ -51,39 +121,16 @@ uint8_t read8(CPU *cpu, uint16_t addr) {
 
     // read from rom
     if (addr <= 0x7FFF) {
-        // Bank 00 is fixed
+        uint32_t offset = (rom_bank(cpu, addr) * 0x4000) + (addr & 0x3FFF);
+        // Bank 00 is fixed, unless mbc1 remaps it
         if (addr <= 0x3FFF) {
-          if ((cpu->mbc_type >= 0x01 && cpu->mbc_type <= 0x03) && cpu->bank_mode == 1) {
-            uint32_t bank_offset = (cpu->curr_ram_bank << 5) * 0x4000;
-            return rom[(bank_offset + addr) % rom_size];
-          }
-          return rom[addr];
+            return rom[offset % rom_size];
         }
         // 0x4000-0x7FFF --> switchable banks
-        else {
-            uint32_t bank = cpu->curr_rom_bank;
-            //mbc1
-            if(cpu->mbc_type >= 0x01 && cpu->mbc_type <= 0x03){
-                uint32_t low = bank & 0x1F;
-                if(low == 0) low = 1;
-                bank = ((cpu->curr_ram_bank & 0x03) << 5) | low;
-            }
-            //mbc3
-            else if(cpu->mbc_type >= 0x0F && cpu->mbc_type <= 0x13){
-                bank &= 0x7F;
-                if(bank == 0) bank = 1;
-            }
-            //mbc5
-            else if (cpu->mbc_type >= 0x19 && cpu->mbc_type <= 0x1E) {
-                bank = cpu->curr_rom_bank & 0x1FF;
-            }
-
-            uint32_t offset = (bank * 0x4000) + (addr - 0x4000);
-            if (offset < rom_size) {
-                return rom[offset];
-            }
-            return 0xFF;
+        if (offset < rom_size) {
+            return rom[offset];
         }
+        return 0xFF;
     }
 
     // cartridge ram
@@ -120,7 +167,7 @@ uint8_t read8(CPU *cpu, uint16_t addr) {
         if ((cpu->ppu.lcdc & 0x80) && ((cpu->ppu.stat & 0x03) == 0x03)) {
             return 0xFF;
         }
-        return cpu->memory[addr];
+        return ppu_read(cpu, addr);
     }
 
     // Echo RAM
@@ -172,6 +219,10 @@ uint8_t read8(CPU *cpu, uint16_t addr) {
 
                 return result;
 
+            // Serial Data
+            case 0xFF01:
+                return cpu->memory[0xFF01];
+
             // Serial Control
             case 0xFF02:
                 return cpu->memory[0xFF02] | 0x7E;
@@ -204,6 +255,22 @@ uint8_t read8(CPU *cpu, uint16_t addr) {
             
             case 0xFF42 ... 0xFF4B:
                 return ppu_read(cpu, addr);
+
+            // CGB only, $FF on DMG
+            case 0xFF4D:
+                if (!cpu->ppu.cgb) return 0xFF;
+                return 0x7E | (cpu->double_speed << 7) | cpu->key1;
+
+            case 0xFF4F:
+            case 0xFF68 ... 0xFF6B:
+                return cpu->ppu.cgb ? ppu_cgb_read(cpu, addr) : 0xFF;
+
+            case 0xFF55:
+                if (!cpu->ppu.cgb) return 0xFF;
+                return (cpu->hdma_active ? 0x00 : 0x80) | ((cpu->hdma_blocks - 1) & 0x7F);
+
+            case 0xFF70:
+                return cpu->ppu.cgb ? (0xF8 | cpu->svbk) : 0xFF;
             
             default: return 0xFF;
         }
@@ -216,12 +283,197 @@ uint8_t read8(CPU *cpu, uint16_t addr) {
     return cpu->memory[addr];
 }
 
+// ------------------------ OAM DMA ---------------------------//
+
+/* $FF46 starts a copy of 160 bytes from $XX00 to OAM, one byte every M-cycle.
+   Meanwhile the CPU only has HRAM and IO: OAM reads $FF, and whatever sits on
+   the same bus as the source (VRAM, or the external bus: ROM, cartridge RAM,
+   WRAM) reads the byte the DMA is moving, writes there get lost.
+
+   Bytes aren't moved as the cycles go by. dma_sync copies everything up to
+   now in one go, when the PPU is about to look at OAM and when the transfer
+   is over. Most games DMA during VBlank, that's a single memcpy then.
+   Copying late is safe, the bus conflict keeps the CPU off the source. */
+
+#define DMA_LENGTH 0xA0
+
+static bool on_vram_bus(uint16_t addr) {
+    return addr >= 0x8000 && addr <= 0x9FFF;
+}
+
+/* len bytes from src (which don't cross a bank) as one block, NULL when
+   they have to go through the bus (cartridge RAM, boot ROM) */
+static const uint8_t *source_block(CPU *cpu, uint16_t src, int len) {
+    // $E0-$FF read WRAM like echo RAM does
+    if (src >= 0xE000)
+        src -= 0x2000;
+
+    if (src <= 0x7FFF) {
+        if (bootrom_flag && src < 0x0100)
+            return NULL;
+        uint32_t offset = (rom_bank(cpu, src) * 0x4000) + (src & 0x3FFF);
+        if (src <= 0x3FFF)
+            offset %= rom_size;
+        return (offset + len <= rom_size) ? &rom[offset] : NULL;
+    }
+    if (src >= 0xA000 && src <= 0xBFFF)
+        return NULL;
+    // CGB: the VRAM bank VBK has mapped
+    if (on_vram_bus(src) && cpu->ppu.vbk)
+        return &cpu->ppu.vram1[src - 0x8000];
+    return &cpu->memory[src];
+}
+
+static const uint8_t *dma_source(CPU *cpu) {
+    return source_block(cpu, cpu->dma_reg << 8, DMA_LENGTH);
+}
+
+static uint8_t dma_byte(CPU *cpu, int i) {
+    const uint8_t *block = dma_source(cpu);
+    return block ? block[i] : bus_read(cpu, ((cpu->dma_reg << 8) + i) & 0xFFFF);
+}
+
+void dma_start(CPU *cpu, uint8_t value) {
+    // a new transfer cuts the running one short
+    if (cpu->dma_active)
+        dma_sync(cpu);
+    cpu->dma_reg = value;
+    cpu->dma_active = true;
+    cpu->dma_starting = true;
+    cpu->dma_cycles = 0;
+    cpu->dma_copied = 0;
+}
+
+void dma_step(CPU *cpu, int mcycles) {
+    // $FF46 was written in the last cycle of that instruction, the next one is the setup
+    if (cpu->dma_starting) {
+        cpu->dma_starting = false;
+        return;
+    }
+    cpu->dma_cycles += mcycles;
+    if (cpu->dma_cycles >= DMA_LENGTH) {
+        dma_sync(cpu);
+        cpu->dma_active = false;
+    }
+}
+
+// Brings OAM up to where the transfer is
+void dma_sync(CPU *cpu) {
+    int target = cpu->dma_cycles < DMA_LENGTH ? cpu->dma_cycles : DMA_LENGTH;
+    int copied = cpu->dma_copied;
+    if (target <= copied)
+        return;
+
+    uint8_t *oam = &cpu->memory[0xFE00];
+    const uint8_t *block = dma_source(cpu);
+    if (block)
+        memcpy(&oam[copied], &block[copied], target - copied);
+    else
+        for (int i = copied; i < target; i++)
+            oam[i] = dma_byte(cpu, i);
+
+    cpu->dma_copied = target;
+    cpu->ppu.oam_dirty = true;
+}
+
+// The bus conflict: true if the CPU can't get at addr right now
+static bool dma_blocks(CPU *cpu, uint16_t addr) {
+    if (!cpu->dma_active || cpu->dma_starting || addr >= 0xFF00)
+        return false;
+    return (addr >= 0xFE00) || on_vram_bus(addr) == on_vram_bus(cpu->dma_reg << 8);
+}
+
+// ------------------------ CGB HDMA and WRAM banks ---------------------------//
+
+/* HDMA copies 16 byte blocks into VRAM (the bank VBK picks), from anywhere
+   but VRAM itself. $FF55 with bit 7 clear copies everything at once, with it
+   set one block every HBlank. The CPU waits 8 M-cycles per block, 16 in double
+   speed, which is the same time. Those go into stall, cpu_step sits them out. */
+
+static void hdma_block(CPU *cpu) {
+    uint8_t bytes[16];
+    const uint8_t *block = source_block(cpu, cpu->hdma_src, 16);
+    if (!block) {
+        for (int i = 0; i < 16; i++)
+            bytes[i] = bus_read(cpu, cpu->hdma_src + i);
+        block = bytes;
+    }
+    ppu_write_block(cpu, 0x8000 | cpu->hdma_dst, block);
+    cpu->hdma_src += 16;
+    cpu->hdma_dst = (cpu->hdma_dst + 16) & 0x1FF0;
+    cpu->hdma_blocks--;
+    cpu->stall += cpu->double_speed ? 16 : 8;
+}
+
+// Mode 0 was just entered
+void hdma_hblank(CPU *cpu) {
+    hdma_block(cpu);
+    if (cpu->hdma_blocks == 0)
+        cpu->hdma_active = false;
+}
+
+static void hdma_write(CPU *cpu, uint16_t addr, uint8_t value) {
+    switch (addr) {
+        case 0xFF51: cpu->hdma_src = (cpu->hdma_src & 0x00F0) | (value << 8); break;
+        case 0xFF52: cpu->hdma_src = (cpu->hdma_src & 0xFF00) | (value & 0xF0); break;
+        case 0xFF53: cpu->hdma_dst = (cpu->hdma_dst & 0x00F0) | ((value & 0x1F) << 8); break;
+        case 0xFF54: cpu->hdma_dst = (cpu->hdma_dst & 0x1F00) | (value & 0xF0); break;
+        case 0xFF55:
+            // bit 7 clear while an HBlank transfer runs stops it
+            if (cpu->hdma_active && !(value & 0x80)) {
+                cpu->hdma_active = false;
+                break;
+            }
+            cpu->hdma_blocks = (value & 0x7F) + 1;
+            if (value & 0x80) {
+                cpu->hdma_active = true;
+                // already in HBlank, or no HBlank coming: the first block goes now
+                if (!(cpu->ppu.lcdc & 0x80) || (cpu->ppu.stat & 0x03) == 0)
+                    hdma_hblank(cpu);
+            }
+            else {
+                while (cpu->hdma_blocks > 0)
+                    hdma_block(cpu);
+            }
+            break;
+    }
+}
+
+/* $D000-$DFFF is one of 7 banks. The mapped one stays in memory[] so
+   everything else (echo RAM, OAM DMA) reads it as on DMG, a switch swaps it out. */
+static void wram_switch(CPU *cpu, uint8_t value) {
+    uint8_t bank = (value & 0x07) ? (value & 0x07) : 1;
+    if (bank == cpu->svbk)
+        return;
+    // a running OAM DMA from $D000 has to get the bytes it's past from the old bank
+    if (cpu->dma_active)
+        dma_sync(cpu);
+    memcpy(cpu->wram[cpu->svbk], &cpu->memory[0xD000], 0x1000);
+    memcpy(&cpu->memory[0xD000], cpu->wram[bank], 0x1000);
+    cpu->svbk = bank;
+}
+
+uint8_t read8(CPU *cpu, uint16_t addr) {
+    uint8_t value;
+    if (dma_blocks(cpu, addr))
+        value = (addr >= 0xFE00) ? 0xFF : dma_byte(cpu, cpu->dma_cycles < DMA_LENGTH ? cpu->dma_cycles : DMA_LENGTH - 1);
+    else
+        value = bus_read(cpu, addr);
+    if (trace_enabled) trace_access(addr, value, TRACE_ACCESS_READ);
+    return value;
+}
+
 uint16_t read16(CPU *cpu, uint16_t addr) {
     return read8(cpu, addr) | (read8(cpu, addr + 1) << 8);
 }
 
 void write8(CPU *cpu, uint16_t addr, uint8_t value) {
-    
+
+    if (trace_enabled) trace_access(addr, value, TRACE_ACCESS_WRITE);
+
+    if (dma_blocks(cpu, addr))
+        return;
+
     // write to MBC
     if (addr <= 0x7FFF) {
 
@@ -362,6 +614,9 @@ void write8(CPU *cpu, uint16_t addr, uint8_t value) {
         if ((cpu->ppu.lcdc & 0x80) && ((cpu->ppu.stat & 0x03) == 0x03)) {
             return; 
         }
+        // the ppu keeps its tile cache in step
+        ppu_write(cpu, addr, value);
+        return;
     }
 
     if (addr >= 0xA000 && addr <= 0xBFFF) {
@@ -398,6 +653,7 @@ void write8(CPU *cpu, uint16_t addr, uint8_t value) {
     if (addr >= 0xFE00 && addr <= 0xFE9F) {
         //printf("Wrote to OAM region in vram\n");
         cpu->memory[addr] = value;
+        cpu->ppu.oam_dirty = true;
         return;
     }
 
@@ -407,13 +663,8 @@ void write8(CPU *cpu, uint16_t addr, uint8_t value) {
     }
 
     if (addr == 0xFF02) { // SC (Serial control)
-        if (value & 0x80) {
-            uint8_t c = cpu->memory[0xFF01]; // read SB
-            serial_write(c);
-
-            cpu->memory[0xFF02] = value & 0x7F; // clear SC
-            return;
-        }
+        serial_control_write(cpu, value);
+        return;
     }
 
     // Write to DIV - resetting DIV
@@ -461,6 +712,25 @@ void write8(CPU *cpu, uint16_t addr, uint8_t value) {
         return;
     }
 
+    // CGB registers, plain memory on DMG
+    if (cpu->ppu.cgb) {
+        switch (addr) {
+            case 0xFF4D:
+                cpu->key1 = value & 0x01;
+                return;
+            case 0xFF4F:
+            case 0xFF68 ... 0xFF6B:
+                ppu_cgb_write(cpu, addr, value);
+                return;
+            case 0xFF51 ... 0xFF55:
+                hdma_write(cpu, addr, value);
+                return;
+            case 0xFF70:
+                wram_switch(cpu, value);
+                return;
+        }
+    }
+
     // Boot ROM disable
     if (addr == 0xFF50 && bootrom_flag) {
         bootrom_flag = false;
@@ -0,0 +1,233 @@
+#include "pixel.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXEL_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define PIXEL_NEON 1
+#include <arm_neon.h>
+#endif
+
+// ------------------------ scalar, works everywhere
+
+static void decode_2bpp_scalar(const uint8_t *planes, uint8_t *ids, int rows) {
+    for (int r = 0; r < rows; r++)
+        pixel_decode_row(planes[r * 2], planes[r * 2 + 1], &ids[r * 8]);
+}
+
+static void map_palette_scalar(const uint8_t *ids, uint8_t *shades, uint8_t palette, int n) {
+    for (int i = 0; i < n; i++)
+        shades[i] = (palette >> (ids[i] * 2)) & 0x03;
+}
+
+static void to_argb_scalar(const uint8_t *index, uint32_t *out, const uint32_t colours[4], int n) {
+    for (int i = 0; i < n; i++)
+        out[i] = colours[index[i] & 0x03];
+}
+
+pixel_decode_fn pixel_decode_2bpp = decode_2bpp_scalar;
+pixel_palette_fn pixel_map_palette = map_palette_scalar;
+pixel_argb_fn pixel_to_argb = to_argb_scalar;
+
+static const char *kernel_name = "scalar";
+
+#ifdef PIXEL_X86
+// ------------------------ SSE2, 16 pixels per step
+
+/* Each lane tests its own bit of the plane byte: lane x looks at bit 7-x,
+   the same byte is broadcast to the 8 lanes of its row. */
+__attribute__((target("sse2")))
+static void decode_2bpp_sse2(const uint8_t *planes, uint8_t *ids, int rows) {
+    const __m128i bits = _mm_setr_epi8((char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+                                       (char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i two = _mm_set1_epi8(2);
+    int r = 0;
+
+    for (; r + 2 <= rows; r += 2) {
+        const uint8_t *p = &planes[r * 2];
+        __m128i lo = _mm_unpacklo_epi64(_mm_set1_epi8((char)p[0]), _mm_set1_epi8((char)p[2]));
+        __m128i hi = _mm_unpacklo_epi64(_mm_set1_epi8((char)p[1]), _mm_set1_epi8((char)p[3]));
+        __m128i lo_set = _mm_cmpeq_epi8(_mm_and_si128(lo, bits), bits);
+        __m128i hi_set = _mm_cmpeq_epi8(_mm_and_si128(hi, bits), bits);
+        __m128i out = _mm_or_si128(_mm_and_si128(lo_set, one), _mm_and_si128(hi_set, two));
+        _mm_storeu_si128((__m128i *)&ids[r * 8], out);
+    }
+    decode_2bpp_scalar(&planes[r * 2], &ids[r * 8], rows - r);
+}
+
+// SSE2 has no byte shuffle, so pick between the 4 palette entries with compares
+__attribute__((target("sse2")))
+static void map_palette_sse2(const uint8_t *ids, uint8_t *shades, uint8_t palette, int n) {
+    __m128i id_value[4], shade[4];
+    for (int c = 0; c < 4; c++) {
+        id_value[c] = _mm_set1_epi8((char)c);
+        shade[c] = _mm_set1_epi8((char)((palette >> (c * 2)) & 0x03));
+    }
+    int i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&ids[i]);
+        __m128i out = _mm_setzero_si128();
+        for (int c = 0; c < 4; c++)
+            out = _mm_or_si128(out, _mm_and_si128(_mm_cmpeq_epi8(v, id_value[c]), shade[c]));
+        _mm_storeu_si128((__m128i *)&shades[i], out);
+    }
+    map_palette_scalar(&ids[i], &shades[i], palette, n - i);
+}
+
+__attribute__((target("sse2")))
+static void to_argb_sse2(const uint8_t *index, uint32_t *out, const uint32_t colours[4], int n) {
+    __m128i id_value[4], colour[4];
+    for (int c = 0; c < 4; c++) {
+        id_value[c] = _mm_set1_epi32(c);
+        colour[c] = _mm_set1_epi32((int)colours[c]);
+    }
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&index[i]);
+        __m128i v16[2] = { _mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero) };
+        for (int h = 0; h < 2; h++) {
+            __m128i v32[2] = { _mm_unpacklo_epi16(v16[h], zero), _mm_unpackhi_epi16(v16[h], zero) };
+            for (int q = 0; q < 2; q++) {
+                __m128i px = _mm_setzero_si128();
+                for (int c = 0; c < 4; c++)
+                    px = _mm_or_si128(px, _mm_and_si128(_mm_cmpeq_epi32(v32[q], id_value[c]), colour[c]));
+                _mm_storeu_si128((__m128i *)&out[i + h * 8 + q * 4], px);
+            }
+        }
+    }
+    to_argb_scalar(&index[i], &out[i], colours, n - i);
+}
+
+// ------------------------ AVX2, 32 pixels per step
+
+__attribute__((target("avx2")))
+static void decode_2bpp_avx2(const uint8_t *planes, uint8_t *ids, int rows) {
+    const __m256i bits = _mm256_set1_epi64x(0x0102040810204080LL);
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i two = _mm256_set1_epi8(2);
+    // plane bytes of 4 rows: row r low plane goes to lanes 8r..8r+7
+    const __m256i spread_lo = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 2, 2, 2, 2,
+                                               4, 4, 4, 4, 4, 4, 4, 4, 6, 6, 6, 6, 6, 6, 6, 6);
+    const __m256i spread_hi = _mm256_add_epi8(spread_lo, one);
+    int r = 0;
+
+    for (; r + 4 <= rows; r += 4) {
+        // 8 bytes of planes in both 128 bit halves, the shuffle works per half
+        __m128i p = _mm_loadl_epi64((const __m128i *)&planes[r * 2]);
+        __m256i both = _mm256_broadcastsi128_si256(p);
+        __m256i lo = _mm256_shuffle_epi8(both, spread_lo);
+        __m256i hi = _mm256_shuffle_epi8(both, spread_hi);
+        __m256i lo_set = _mm256_cmpeq_epi8(_mm256_and_si256(lo, bits), bits);
+        __m256i hi_set = _mm256_cmpeq_epi8(_mm256_and_si256(hi, bits), bits);
+        __m256i out = _mm256_or_si256(_mm256_and_si256(lo_set, one), _mm256_and_si256(hi_set, two));
+        _mm256_storeu_si256((__m256i *)&ids[r * 8], out);
+    }
+    decode_2bpp_sse2(&planes[r * 2], &ids[r * 8], rows - r);
+}
+
+__attribute__((target("avx2")))
+static void map_palette_avx2(const uint8_t *ids, uint8_t *shades, uint8_t palette, int n) {
+    __m256i table = _mm256_setr_epi8(palette & 3, (palette >> 2) & 3, (palette >> 4) & 3, (palette >> 6) & 3,
+                                     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                     palette & 3, (palette >> 2) & 3, (palette >> 4) & 3, (palette >> 6) & 3,
+                                     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    int i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&ids[i]);
+        _mm256_storeu_si256((__m256i *)&shades[i], _mm256_shuffle_epi8(table, v));
+    }
+    map_palette_sse2(&ids[i], &shades[i], palette, n - i);
+}
+
+__attribute__((target("avx2")))
+static void to_argb_avx2(const uint8_t *index, uint32_t *out, const uint32_t colours[4], int n) {
+    __m256i table = _mm256_setr_epi32((int)colours[0], (int)colours[1], (int)colours[2], (int)colours[3],
+                                      (int)colours[0], (int)colours[1], (int)colours[2], (int)colours[3]);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&index[i]));
+        _mm256_storeu_si256((__m256i *)&out[i], _mm256_permutevar8x32_epi32(table, v));
+    }
+    to_argb_scalar(&index[i], &out[i], colours, n - i);
+}
+#endif
+
+#ifdef PIXEL_NEON
+// ------------------------ NEON, 8 pixels per step
+
+static void decode_2bpp_neon(const uint8_t *planes, uint8_t *ids, int rows) {
+    static const uint8_t bit_table[8] = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
+    const uint8x8_t bits = vld1_u8(bit_table);
+    const uint8x8_t one = vdup_n_u8(1);
+    const uint8x8_t two = vdup_n_u8(2);
+
+    for (int r = 0; r < rows; r++) {
+        uint8x8_t lo = vand_u8(vtst_u8(vdup_n_u8(planes[r * 2]), bits), one);
+        uint8x8_t hi = vand_u8(vtst_u8(vdup_n_u8(planes[r * 2 + 1]), bits), two);
+        vst1_u8(&ids[r * 8], vorr_u8(lo, hi));
+    }
+}
+
+static void map_palette_neon(const uint8_t *ids, uint8_t *shades, uint8_t palette, int n) {
+    const uint8_t table_bytes[8] = { palette & 3, (palette >> 2) & 3, (palette >> 4) & 3, (palette >> 6) & 3 };
+    const uint8x8_t table = vld1_u8(table_bytes);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8)
+        vst1_u8(&shades[i], vtbl1_u8(table, vld1_u8(&ids[i])));
+    map_palette_scalar(&ids[i], &shades[i], palette, n - i);
+}
+
+static void to_argb_neon(const uint8_t *index, uint32_t *out, const uint32_t colours[4], int n) {
+    uint32x4_t colour[4];
+    for (int c = 0; c < 4; c++)
+        colour[c] = vdupq_n_u32(colours[c]);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t v16 = vmovl_u8(vld1_u8(&index[i]));
+        uint32x4_t v32[2] = { vmovl_u16(vget_low_u16(v16)), vmovl_u16(vget_high_u16(v16)) };
+        for (int q = 0; q < 2; q++) {
+            uint32x4_t px = colour[0];
+            for (int c = 1; c < 4; c++)
+                px = vbslq_u32(vceqq_u32(v32[q], vdupq_n_u32(c)), colour[c], px);
+            vst1q_u32(&out[i + q * 4], px);
+        }
+    }
+    to_argb_scalar(&index[i], &out[i], colours, n - i);
+}
+#endif
+
+void pixel_init(void) {
+#ifdef PIXEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        pixel_decode_2bpp = decode_2bpp_avx2;
+        pixel_map_palette = map_palette_avx2;
+        pixel_to_argb = to_argb_avx2;
+        kernel_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        pixel_decode_2bpp = decode_2bpp_sse2;
+        pixel_map_palette = map_palette_sse2;
+        pixel_to_argb = to_argb_sse2;
+        kernel_name = "sse2";
+    }
+#elif defined(PIXEL_NEON)
+    pixel_decode_2bpp = decode_2bpp_neon;
+    pixel_map_palette = map_palette_neon;
+    pixel_to_argb = to_argb_neon;
+    kernel_name = "neon";
+#endif
+}
+
+const char *pixel_kernel_name(void) {
+    return kernel_name;
+}
@@ -1,8 +1,14 @@
 #include "cpu.h"
 #include "platform.h"
-static uint8_t bg_indices[SCREEN_WIDTH];
+#include "pixel.h"
+#include "render.h"
+#include "capture.h"
+
+static void start_mode3(PPU *ppu, CPU *cpu);
 
 void ppu_init(PPU *ppu) {
+    pixel_init();
+
     // Default values for LCD registers 
     ppu->lcdc = 0x00;
     ppu->stat = 0x85;
@@ -20,11 +26,99 @@ void ppu_init(PPU *ppu) {
 
     ppu->mode_cycles = 0;
     ppu->scanline    = 0;
+    ppu->oam_dirty   = true;
+    ppu->mode3_length  = 172;
+    ppu->mode3_log_len = 0;
+    ppu->fifo_always   = false;
+    ppu->frameskip     = 0;
+    ppu->running_late  = false;
+    ppu->skip_frame    = false;
+    ppu->skip_run      = 0;
+    ppu->frames_skipped = 0;
+
+    memset(ppu->line_key_valid, 0, sizeof(ppu->line_key_valid));
+    memset(ppu->line_reused, 0, sizeof(ppu->line_reused));
+    memset(ppu->map_gen, 0, sizeof(ppu->map_gen));
+    memset(ppu->tile_gen, 0, sizeof(ppu->tile_gen));
+    ppu->lines_drawn  = 0;
+    ppu->lines_reused = 0;
+    ppu->cgb = false;
+    ppu->vbk = 0;
+    ppu->palette_gen = 0;
+
+    // VRAM gets cleared with the rest of memory, so every tile decodes to 0
+    memset(ppu->tiles, 0, sizeof(ppu->tiles));
+    memset(ppu->tiles_xflip, 0, sizeof(ppu->tiles_xflip));
+    // the same goes for the maps: every row holds tile 0 and the layers are all 0
+    ppu->use_layers = false;
+    memset(ppu->layers, 0, sizeof(ppu->layers));
+    memset(ppu->map_rows, 0, sizeof(ppu->map_rows));
+    ppu->map_rows[0][0] = ppu->map_rows[1][0] = 0xFFFFFFFF;
+    ppu->layer_dirty[0] = ppu->layer_dirty[1] = 0;
+
+    // Clear framebuffer to white, in all three slots
+    ppu->indexed = false;
+    uint32_t white = GAMEBOY_COLOURS[0];
+    for (int f = 0; f < 3; f++) {
+        ppu->frames[f].seq = 0;
+        ppu->frames[f].period = 0;
+        memset(ppu->frames[f].shades, 0, sizeof(ppu->frames[f].shades));
+        for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
+            ppu->frames[f].pixels[i] = white;
+        }
+    }
+    ppu->front = 0;
+    atomic_init(&ppu->frame_state, 1);
+    ppu->back = 2;
+    ppu->published = 1;
+    ppu->frame_seq = 0;
+    ppu->periods = 0;
+    ppu->off_dots = 0;
+    ppu->framebuffer = ppu->frames[ppu->back].pixels;
+    ppu->shades = ppu->frames[ppu->back].shades;
+}
+
+/* Producer side: the frame in back is done, swap it into the middle slot and draw into the old middle.
+   That's the core, or the render thread with -renderthreads. */
+void ppu_publish_frame(PPU *ppu, uint32_t period) {
+    ppu->frames[ppu->back].period = period;
+    if (capture_enabled)
+        capture_frame(&ppu->frames[ppu->back], ppu->indexed ? GAMEBOY_COLOURS : NULL);
+    ppu->frames[ppu->back].seq = ++ppu->frame_seq;
+    ppu->published = ppu->back;
+    unsigned middle = atomic_exchange_explicit(&ppu->frame_state, ppu->back | FRAME_NEW, memory_order_acq_rel);
+    ppu->back = middle & 0x03;
+    ppu->framebuffer = ppu->frames[ppu->back].pixels;
+    ppu->shades = ppu->frames[ppu->back].shades;
+}
+
+// Decides at the end of a frame whether the next one gets drawn
+static bool skip_next_frame(PPU *ppu) {
+    if (ppu->frameskip == FRAMESKIP_AUTO)
+        return ppu->running_late && ppu->skip_run < FRAMESKIP_AUTO_MAX;
+    return ppu->skip_run < ppu->frameskip;
+}
 
-    // Clear framebuffer to white
+/* Presenter side: the newest finished frame. Stays valid until the next call,
+   the core never touches it in the meantime. */
+const Frame *ppu_acquire_frame(PPU *ppu) {
+    if (atomic_load_explicit(&ppu->frame_state, memory_order_relaxed) & FRAME_NEW) {
+        unsigned middle = atomic_exchange_explicit(&ppu->frame_state, ppu->front, memory_order_acq_rel);
+        ppu->front = middle & 0x03;
+    }
+    return &ppu->frames[ppu->front];
+}
+
+/* FNV-1a over the shades, not the pixels: the same picture hashes the same
+   with any palette (-mgb) and with -indexed. On CGB that takes in which palette
+   a pixel came from, not the colours in it. */
+uint64_t frame_hash(const Frame *frame) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
     for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
-        ppu->framebuffer[i] = GAMEBOY_COLOURS[0];
+        hash ^= frame->shades[i];
+        hash *= 0x100000001B3ULL;
     }
+    return hash;
 }
 
 void lcd_off(PPU *ppu){
@@ -33,9 +127,20 @@ void lcd_off(PPU *ppu){
     ppu->stat = (ppu->stat & 0xFC) | 0x00;
     ppu->mode_cycles = 0;
     ppu->wly_latch = false;
-    for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
-        ppu->framebuffer[i] = GAMEBOY_COLOURS[0];
+    ppu->off_dots = 0;
+    // a switched off screen shows white, not whatever was drawn last
+    if (render_enabled) {
+        render_blank_frame();
     }
+    else {
+        uint32_t white = ppu->cgb ? 0xFFFFFFFF : GAMEBOY_COLOURS[0];
+        memset(ppu->shades, 0, SCREEN_WIDTH * SCREEN_HEIGHT);
+        for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT && !ppu->indexed; i++) {
+            ppu->framebuffer[i] = white;
+        }
+        ppu_publish_frame(ppu, ppu->periods);
+    }
+    memset(ppu->line_key_valid, 0, sizeof(ppu->line_key_valid));
     ppu->wly = 0;
 
 }
@@ -50,15 +155,25 @@ void check_coincidence(PPU *ppu, CPU *cpu) {
         ppu->stat &= ~0x04; // Clear coincidence flag
 }
 
-void ppu_step(PPU *ppu, CPU *cpu) {
-    if (!(ppu->lcdc & 0x80)) return;
-    ppu->mode_cycles += cpu->cycles*4;
+// dots: T-cycles at normal speed, the PPU doesn't speed up with the CPU
+void ppu_step(PPU *ppu, CPU *cpu, int dots) {
+    if (!(ppu->lcdc & 0x80)) {
+        // the screen stays white, that still takes frame periods
+        ppu->off_dots += dots;
+        if (ppu->off_dots >= 70224) {
+            ppu->off_dots -= 70224;
+            ppu->periods++;
+        }
+        return;
+    }
+    ppu->mode_cycles += dots;
 
     //OAM
     switch (ppu->stat & 0x03) {
     case 0: // HBlank
-        if (ppu->mode_cycles >= 204) {
-            ppu->mode_cycles -= 204;
+        // a line is 456 cycles, HBlank gets whatever OAM scan and drawing left
+        if (ppu->mode_cycles >= 376 - ppu->mode3_length) {
+            ppu->mode_cycles -= 376 - ppu->mode3_length;
             ppu->ly++;
             check_coincidence(ppu, cpu);
 
@@ -66,7 +181,19 @@ void ppu_step(PPU *ppu, CPU *cpu) {
                 // Enter V-Blank
                 ppu->stat = (ppu->stat & 0xFC) | 0x01;
                 cpu->iflag |= 0x01; // Request V-Blank Interrupt
-                //present_screen(ppu, cpu);
+                // a skipped frame is half stale, the presenter keeps the last one.
+                // The render thread can also be too busy to take the frame
+                if (ppu->skip_frame || (render_enabled && !render_end_frame())) {
+                    ppu->frames_skipped++;
+                    ppu->skip_run++;
+                }
+                else {
+                    if (!render_enabled)
+                        ppu_publish_frame(ppu, ppu->periods);
+                    ppu->skip_run = 0;
+                }
+                ppu->periods++;
+                ppu->skip_frame = skip_next_frame(ppu);
             } 
             else {
                 // Enter OAM Scan for the next scanline
@@ -101,37 +228,76 @@ void ppu_step(PPU *ppu, CPU *cpu) {
             ppu->mode_cycles -= 80;
             // Enter Drawing mode
             ppu->stat = (ppu->stat & 0xFC) | 0x03;
+            start_mode3(ppu, cpu);
         }
         break;
 
     case 3: // Drawing
         //printf("Drawing :D\n\n");
-        if (ppu->mode_cycles >= 172) {
-            ppu->mode_cycles -= 172;
+        if (ppu->mode_cycles >= ppu->mode3_length) {
+            ppu->mode_cycles -= ppu->mode3_length;
             // Enter H-Blank
             ppu->stat = (ppu->stat & 0xFC) | 0x00;
             if (ppu->stat & 0x08) cpu->iflag |= 0x02;
             render_scanline(ppu, cpu);
+            if (cpu->hdma_active)
+                hdma_hblank(cpu);
         }
         break;
     }
 }
 
-void dma_transfer(CPU *cpu, uint8_t value) {
-    //printf("Hit a DMA\n");
-    uint16_t src = value << 8;
-    for (uint16_t i = 0; i < 0xA0; i++) {
-        uint8_t data = read8(cpu, src + i); 
-        write8(cpu, 0xFE00 + i, data);
-    }
-    // memcpy(&cpu->memory[0xFE00], &cpu->memory[src], 0xA0);
+// Decodes one row (2 bytes) of a tile into colour ids, offset is from $8000
+void decode_tile_row(const uint8_t *vram, uint8_t (*tiles)[8][8], uint8_t (*tiles_xflip)[8][8], uint16_t offset) {
+    offset &= ~1;
+    uint16_t tile = offset / 16;
+    uint8_t row = (offset % 16) / 2;
+
+    pixel_decode_row(vram[offset], vram[offset + 1], tiles[tile][row]);
+    for (int x = 0; x < 8; x++)
+        tiles_xflip[tile][row][7 - x] = tiles[tile][row][x];
+}
+
+// A whole tile (16 bytes from offset, which is from $8000) decoded in one go
+static void decode_tile(const uint8_t *vram, uint8_t (*tiles)[8][8], uint8_t (*tiles_xflip)[8][8], uint16_t offset) {
+    uint16_t tile = offset / 16;
+    pixel_decode_2bpp(&vram[offset & ~15], tiles[tile][0], 8);
+    for (int row = 0; row < 8; row++)
+        for (int x = 0; x < 8; x++)
+            tiles_xflip[tile][row][7 - x] = tiles[tile][row][x];
+}
+
+// Tile data changed: dirty the map rows that point at it in the current addressing mode
+static void tile_changed(PPU *ppu, uint16_t tile) {
+    int number;
+    if (ppu->lcdc & 0x10)
+        number = tile < 256 ? tile : -1;   // $8000, tiles 0-255
+    else
+        number = tile >= 128 ? tile & 0xFF : -1; // $9000 signed, tiles 128-383
+    if (number < 0)
+        return;
+    ppu->layer_dirty[0] |= ppu->map_rows[0][number];
+    ppu->layer_dirty[1] |= ppu->map_rows[1][number];
+}
+
+// A map entry changed from old to the value now in memory
+static void map_changed(PPU *ppu, CPU *cpu, uint16_t addr, uint8_t old) {
+    int map = (addr >> 10) & 1;
+    int row = (addr >> 5) & 31;
+    const uint8_t *map_row = &cpu->memory[addr & ~31];
+
+    ppu->layer_dirty[map] |= 1u << row;
+    ppu->map_rows[map][map_row[addr & 31]] |= 1u << row;
+    // the old number might still be somewhere else in the row
+    if (!memchr(map_row, old, 32))
+        ppu->map_rows[map][old] &= ~(1u << row);
 }
 
 uint8_t ppu_read(CPU *cpu, uint16_t addr) {
     PPU *ppu = &cpu->ppu;
 
     if (addr >= 0x8000 && addr <= 0x9FFF) {
-        return cpu->memory[addr];
+        return ppu->vbk ? ppu->vram1[addr - 0x8000] : cpu->memory[addr];
     }
 
     switch (addr) {
@@ -141,6 +307,7 @@ uint8_t ppu_read(CPU *cpu, uint16_t addr) {
         case 0xFF43: return ppu->scx;
         case 0xFF44: return ppu->ly;   
         case 0xFF45: return ppu->lyc;
+        case 0xFF46: return cpu->dma_reg;
         case 0xFF47: return ppu->bgp;
         case 0xFF48: return ppu->obp0;
         case 0xFF49: return ppu->obp1;
@@ -151,16 +318,70 @@ uint8_t ppu_read(CPU *cpu, uint16_t addr) {
     return 0xFF; // unmapped
 }
 
+// Remembers writes that change how the line being drawn looks
+static void log_mode3_write(PPU *ppu, uint16_t addr, uint8_t value) {
+    switch (addr) {
+        case 0xFF40: case 0xFF42: case 0xFF43: case 0xFF47:
+        case 0xFF48: case 0xFF49: case 0xFF4A: case 0xFF4B:
+            if (ppu->mode3_log_len < MODE3_LOG_SIZE) {
+                RegWrite *w = &ppu->mode3_log[ppu->mode3_log_len++];
+                w->dot = ppu->mode_cycles;
+                w->reg = addr & 0xFF;
+                w->value = value;
+            }
+            break;
+    }
+}
+
 void ppu_write(CPU *cpu, uint16_t addr, uint8_t value) {
     PPU *ppu = &cpu->ppu;
 
+    if ((ppu->lcdc & 0x80) && (ppu->stat & 0x03) == 0x03)
+        log_mode3_write(ppu, addr, value);
+
+    // CGB bank 1: tiles 384-767 and the map attributes, -layers and the render threads are off then
+    if (addr >= 0x8000 && addr <= 0x9FFF && ppu->vbk) {
+        uint8_t *byte = &ppu->vram1[addr - 0x8000];
+        if (*byte == value)
+            return;
+        *byte = value;
+        if (addr <= 0x97FF) {
+            decode_tile_row(ppu->vram1, ppu->tiles + 384, ppu->tiles_xflip + 384, addr - 0x8000);
+            ppu->tile_gen[3 + (addr - 0x8000) / 0x800]++;
+        }
+        else
+            ppu->map_gen[(addr >> 10) & 1][(addr >> 5) & 31]++;
+        return;
+    }
+
     if (addr >= 0x8000 && addr <= 0x9FFF) {
+        uint8_t old = cpu->memory[addr];
+        if (old == value)
+            return; // nothing to decode, and lines drawn from it can still be reused
         cpu->memory[addr] = value;
+        if (render_enabled)
+            render_log_vram(addr, value);
+        // 0x9800 and up are the tile maps
+        if (addr <= 0x97FF) {
+            decode_tile_row(&cpu->memory[0x8000], ppu->tiles, ppu->tiles_xflip, addr - 0x8000);
+            ppu->tile_gen[(addr - 0x8000) / 0x800]++;
+            tile_changed(ppu, (addr - 0x8000) / 16);
+        }
+        else {
+            ppu->map_gen[(addr >> 10) & 1][(addr >> 5) & 31]++;
+            map_changed(ppu, cpu, addr, old);
+        }
         return;
     }
 
     switch (addr) {
-        case 0xFF40:ppu->lcdc = value; 
+        case 0xFF40:// object size decides which lines an object is on
+                    if ((ppu->lcdc ^ value) & 0x04)
+                        ppu->oam_dirty = true;
+                    // the other tile addressing mode, every map entry points somewhere else
+                    if ((ppu->lcdc ^ value) & 0x10)
+                        ppu->layer_dirty[0] = ppu->layer_dirty[1] = 0xFFFFFFFF;
+                    ppu->lcdc = value; 
                     // if lcd is being switched off, set window line counter back to 0
                     if (!(value & 0x80))// Bit 7 is the LCD enable bit
                         lcd_off(ppu);
@@ -177,13 +398,63 @@ void ppu_write(CPU *cpu, uint16_t addr, uint8_t value) {
         case 0xFF4A: ppu->wy   = value; break;
         case 0xFF4B: ppu->wx   = value; break;
 
-        case 0xFF46: // DMA Trigger
-            dma_transfer(cpu, value);
-            cpu->cycles += 160;
+        case 0xFF46: // DMA Trigger, runs alongside the CPU from here
+            dma_start(cpu, value);
             break;
     }
 }
 
+/* HDMA: 16 bytes into VRAM at addr (16 aligned), in the bank VBK picks.
+   The same as 16 ppu_writes, but one copy, one tile decode and one log
+   entry for the render thread. */
+void ppu_write_block(CPU *cpu, uint16_t addr, const uint8_t *data) {
+    PPU *ppu = &cpu->ppu;
+    uint16_t offset = (addr - 0x8000) & 0x1FF0;
+
+    // mid-line writes have to be seen one at a time
+    if ((ppu->lcdc & 0x80) && (ppu->stat & 0x03) == 0x03) {
+        for (int i = 0; i < 16; i++)
+            ppu_write(cpu, 0x8000 + offset + i, data[i]);
+        return;
+    }
+
+    if (ppu->vbk) {
+        uint8_t *dst = &ppu->vram1[offset];
+        if (memcmp(dst, data, 16) == 0)
+            return;
+        memmove(dst, data, 16);
+        if (offset < 0x1800) {
+            decode_tile(ppu->vram1, ppu->tiles + 384, ppu->tiles_xflip + 384, offset);
+            ppu->tile_gen[3 + offset / 0x800]++;
+        }
+        else
+            ppu->map_gen[(offset >> 10) & 1][(offset >> 5) & 31]++;
+        return;
+    }
+
+    uint8_t *dst = &cpu->memory[0x8000 + offset];
+    if (memcmp(dst, data, 16) == 0)
+        return; // lines drawn from it can still be reused
+    uint8_t old[16];
+    memcpy(old, dst, 16);
+    memmove(dst, data, 16);
+    if (render_enabled)
+        render_log_vram_block(0x8000 + offset, dst, 16);
+
+    if (offset < 0x1800) {
+        decode_tile(&cpu->memory[0x8000], ppu->tiles, ppu->tiles_xflip, offset);
+        ppu->tile_gen[offset / 0x800]++;
+        tile_changed(ppu, offset / 16);
+    }
+    else {
+        // a map row is 32 entries, the block is half of one
+        ppu->map_gen[(offset >> 10) & 1][(offset >> 5) & 31]++;
+        for (int i = 0; i < 16; i++)
+            if (old[i] != dst[i])
+                map_changed(ppu, cpu, 0x8000 + offset + i, old[i]);
+    }
+}
+
 /*IMPORTANT --------------------------------------------------------------------------
     "window is active" also probably needs a tweak - there's a hidden "window y latch" that is set to false at the start of the 
     frame and true when WY==LY the first time in the frame.
@@ -191,109 +462,102 @@ void ppu_write(CPU *cpu, uint16_t addr, uint8_t value) {
     i.e. the condition for window is "WY_latch is true and WX is <=166" not LY>=WY 
 */
 
-// It says bg on the tin, but this renders both bg and window
-void render_bg(PPU *ppu, CPU *cpu){
-    if(ppu->ly == ppu->wy)
-        ppu->wly_latch = true;
-    // LCDC sets these values
-    //get the addressing mode: $8000 unsigned or $9000 signed (8800 to 97FF)
-    uint16_t tile_data_base = (ppu->lcdc & 0x10) ? 0x8000 : 0x9000;
-    // 0 = 9800–9BFF; 1 = 9C00–9FFF
-    uint16_t bg_tile_map_base = (ppu->lcdc & 0x08) ? 0x9C00 : 0x9800;
-    /// 0 = 9800–9BFF; 1 = 9C00–9FFF
-    uint16_t window_tile_map_base = (ppu->lcdc & 0x40) ? 0x9C00 : 0x9800;
-
-    // Check if the window is enabled and visible on this scanline
-    bool window_visible = (ppu->lcdc & 0x20) && ppu->wly_latch && (ppu->wx < 166);
-
-    // just initialising here
-    uint8_t colour_id = 0;
+/* Fills colour ids [start, end) of a line from a tile map, a tile row at a time.
+   map_x / map_y is the spot in the 256x256 map that lands on pixel start.
+   The map and tiles come straight out of VRAM, the renderer runs outside of the bus. */
+static void render_tile_row(const TileSource *src, uint8_t *ids, uint8_t lcdc, uint16_t map_base, uint8_t map_x, uint8_t map_y, int start, int end) {
+    const uint8_t *map_row = &src->vram[map_base - 0x8000 + (map_y / 8) * 32];
+    uint8_t tile_line = map_y % 8;
+    int i = start;
+    while (i < end) {
+        uint8_t tile_number = map_row[map_x / 8];
+        // $8000 unsigned or $9000 signed (tiles 128-383 in the cache)
+        uint16_t tile = (lcdc & 0x10) ? tile_number : 256 + (int8_t)tile_number;
+        const uint8_t *row = src->tiles[tile][tile_line];
+
+        // only the first and last tile can be cut, when scrolled
+        int x = map_x % 8;
+        int count = (8 - x < end - i) ? 8 - x : end - i;
+        memcpy(&ids[i], &row[x], count);
+        i += count;
+        map_x += count;
+    }
+}
 
-    // Rendering BG and Window
-    // for every pixel in this scanline
-    for (int i = 0; i < SCREEN_WIDTH; i++) {
-        // Check if the current pixel is inside the window's X range
-        bool in_window = window_visible && (i >= (ppu->wx - 7));
-        if (in_window) {   
-            uint8_t window_x = i - (ppu->wx - 7);  
-            
-            //8 bits per tile and 
-            uint16_t tile_map_addr = window_tile_map_base  + ((ppu->wly / 8) * 32) + (window_x / 8);
-            uint8_t tile_number = read8(cpu, tile_map_addr);
-            
-            uint16_t tile_addr;
-            // Choose signed or unsigned addressing
-            if (tile_data_base == 0x8000) {
-                tile_addr = tile_data_base + (tile_number * 16);
-            } else {
-                tile_addr = tile_data_base + ((int8_t)tile_number * 16);
-            }
+// Composes map row `row` (8 lines of the layer) out of the decoded tiles
+static void compose_layer_row(PPU *ppu, CPU *cpu, int map, int row) {
+    const uint8_t *map_row = &cpu->memory[(map ? 0x9C00 : 0x9800) + row * 32];
+    for (int col = 0; col < 32; col++) {
+        uint16_t tile = (ppu->lcdc & 0x10) ? map_row[col] : 256 + (int8_t)map_row[col];
+        for (int y = 0; y < 8; y++)
+            memcpy(&ppu->layers[map][row * 8 + y][col * 8], ppu->tiles[tile][y], 8);
+    }
+    ppu->layer_dirty[map] &= ~(1u << row);
+}
 
-            uint8_t line_in_tile = ppu->wly % 8;
-            uint8_t byte1 = read8(cpu, tile_addr + line_in_tile * 2);
-            uint8_t byte2 = read8(cpu, tile_addr + line_in_tile * 2 + 1);
- 
-            // Combine the bytes to get the colour ID
-            uint8_t bit = 7 - (window_x % 8);
-            colour_id = ((byte2 >> bit) & 1) << 1 | ((byte1 >> bit) & 1);
+/* render_tile_row for -layers: the same colour ids, copied out of a composed layer.
+   The bg wraps around at x 255, so it can take two copies. */
+static void render_layer_row(CPU *cpu, uint8_t *ids, uint16_t map_base, uint8_t map_x, uint8_t map_y, int start, int end) {
+    PPU *ppu = &cpu->ppu;
+    int map = (map_base == 0x9C00);
+    if (ppu->layer_dirty[map] & (1u << (map_y / 8)))
+        compose_layer_row(ppu, cpu, map, map_y / 8);
+
+    const uint8_t *line = ppu->layers[map][map_y];
+    int count = end - start;
+    int first = (256 - map_x < count) ? 256 - map_x : count;
+    memcpy(&ids[start], &line[map_x], first);
+    if (first < count)
+        memcpy(&ids[start + first], line, count - first);
+}
 
-            // Get the actual colour from the palette and write to the framebuffer
-            uint8_t shade = (ppu->bgp >> (colour_id * 2)) & 0x03;
-            ppu->framebuffer[ppu->ly * SCREEN_WIDTH + i] = GAMEBOY_COLOURS[shade];
+static void render_map_row(const TileSource *src, uint8_t *ids, uint8_t lcdc, uint16_t map_base, uint8_t map_x, uint8_t map_y, int start, int end) {
+    if (src->layer_cpu)
+        render_layer_row(src->layer_cpu, ids, map_base, map_x, map_y, start, end);
+    else
+        render_tile_row(src, ids, lcdc, map_base, map_x, map_y, start, end);
+}
 
-    // ------------------------------------------------------------------------------------        
+// It says bg on the tin, but this renders both bg and window. ids gets the colour ids for render_objects
+static void render_bg(const LineState *line, const TileSource *src, uint8_t *ids, uint8_t *shades){
+    const LineRegs *regs = &line->regs;
+    // LCDC sets these values
+    // 0 = 9800–9BFF; 1 = 9C00–9FFF
+    uint16_t bg_tile_map_base = (regs->lcdc & 0x08) ? 0x9C00 : 0x9800;
+    /// 0 = 9800–9BFF; 1 = 9C00–9FFF
+    uint16_t window_tile_map_base = (regs->lcdc & 0x40) ? 0x9C00 : 0x9800;
 
-        } else if (ppu->lcdc & 0x01) {
-            // Draw Background Pixel 
-            uint8_t scrolled_y = (ppu->scy + ppu->ly) % 256; 
-            uint8_t scrolled_x = (ppu->scx + i) % 256;
-            
-            // Get tile from the background tile map
-            uint16_t tile_index_addr = bg_tile_map_base + ((scrolled_y / 8) * 32) + (scrolled_x / 8);
-            uint8_t tile_number = read8(cpu, tile_index_addr);
-            
-            // Calculate the address of the tile's pixel data
-            uint16_t tile_addr;
-            if (tile_data_base == 0x8000) {
-                 tile_addr = tile_data_base + (tile_number * 16);
-            } else {
-                 tile_addr = tile_data_base + ((int8_t)tile_number * 16);
-            }
-            
-            // Get the two bytes for the current line of the tile
-            uint8_t tile_line = scrolled_y % 8;
-            uint8_t byte1 = read8(cpu, tile_addr + tile_line * 2);
-            uint8_t byte2 = read8(cpu, tile_addr + tile_line * 2 + 1);
-            
-            // Combine the bytes to get the colour ID
-            uint8_t bit = 7 - (scrolled_x % 8);
-            colour_id = ((byte2 >> bit) & 1) << 1 | ((byte1 >> bit) & 1);
+    // The window covers everything right of WX-7
+    int window_start = SCREEN_WIDTH;
+    if (line->window)
+        window_start = (regs->wx < 7) ? 0 : regs->wx - 7;
 
-            // Get the actual colour from the palette and write to the framebuffer
-            uint8_t shade = (ppu->bgp >> (colour_id * 2)) & 0x03;
-            ppu->framebuffer[ppu->ly * SCREEN_WIDTH + i] = GAMEBOY_COLOURS[shade];
-        }
-        else{
-            ppu->framebuffer[ppu->ly * SCREEN_WIDTH + i] = GAMEBOY_COLOURS[ppu->bgp & 0x03];
-            colour_id = 0;
-        }
-        bg_indices[i] = colour_id;
+    // Background left of the window
+    if (regs->lcdc & 0x01) {
+        render_map_row(src, ids, regs->lcdc, bg_tile_map_base, regs->scx, regs->scy + line->ly, 0, window_start);
     }
-    // Incrementing window line counter
+    else {
+        memset(ids, 0, window_start);
+    }
+
     // If the window exists in this scanline
-    if (window_visible) {
-        ppu->wly += 1;
+    if (line->window) {
+        // with WX < 7 the window starts part way into its first tile
+        uint8_t window_x = window_start - (regs->wx - 7);
+        render_map_row(src, ids, regs->lcdc, window_tile_map_base, window_x, line->wly, window_start, SCREEN_WIDTH);
     }
+
+    pixel_map_palette(ids, shades, regs->bgp, SCREEN_WIDTH);
 }
 
 // Insertion sorts the objects based on x coordinate order 
-void ins_sort_obj(Sprite arr[], int n) {
+void ins_sort_obj(uint8_t arr[], int n, const Sprite oam[]) {
     int i, j;
-    Sprite key;
+    uint8_t key;
     for (i = 1; i < n; i++) {
         key = arr[i];
         j = i - 1;
-        while (j >= 0 && arr[j].x > key.x) {
+        while (j >= 0 && oam[arr[j]].x > oam[key].x) {
             arr[j + 1] = arr[j];
             j = j - 1;
         }
@@ -301,51 +565,58 @@ void ins_sort_obj(Sprite arr[], int n) {
     }
 }
 
+/*
+According to GBEDG:
+    Sprite X-Position must be greater than 0
+    LY + 16 must be greater than or equal to Sprite Y-Position
+    LY + 16 must be less than Sprite Y-Position + Sprite Height (8 in Normal Mode, 16 in Tall-Sprite-Mode)
+    The amount of sprites already stored in the OAM Buffer must be less than 10
 
-void render_objects(PPU *ppu, CPU *cpu){
+This is esentially OAM scan, done for every line at once. OAM barely
+changes during a frame, so most frames only do this once if at all.
+*/
+static void build_line_objects(PPU *ppu, CPU *cpu) {
+    const Sprite *oam = (const Sprite *)&cpu->memory[0xFE00];
+    int obj_height = (ppu->lcdc & 0x04) ? 16 : 8;
+
+    memset(ppu->line_obj_count, 0, sizeof(ppu->line_obj_count));
+
+    // in oam order, so the first 10 on a line win
+    for (int i = 0; i < 40; i++) {
+        if (oam[i].x <= 0) continue;
+        int top = oam[i].y - 16;
+        for (int line = top < 0 ? 0 : top; line < top + obj_height && line < SCREEN_HEIGHT; line++) {
+            if (ppu->line_obj_count[line] < 10)
+                ppu->line_objs[line][ppu->line_obj_count[line]++] = i;
+        }
+    }
 
-    if (!(ppu->lcdc & 0x02)) return; // Sprites disabled
-    uint8_t obj_height = (ppu->lcdc & 0x04) ? 16 : 8;
-    //oam is storing 40 obects. each object has the four properties of the Sprite struct
-    Sprite oam[40];
-    memcpy(oam, &cpu->memory[0xFE00], 0xA0);
+    // Sort the objects by x coordinate increasing priority
+    for (int line = 0; line < SCREEN_HEIGHT; line++)
+        ins_sort_obj(ppu->line_objs[line], ppu->line_obj_count[line], oam);
 
-    // This buffer stores the visible objects for current scanline
-    Sprite sp_buffer[10];
-    int obj_count = 0;
+    ppu->oam_dirty = false;
+}
 
-    /*
-    According to GBEDG:
-        Sprite X-Position must be greater than 0
-        LY + 16 must be greater than or equal to Sprite Y-Position
-        LY + 16 must be less than Sprite Y-Position + Sprite Height (8 in Normal Mode, 16 in Tall-Sprite-Mode)
-        The amount of sprites already stored in the OAM Buffer must be less than 10
-    
-    Adding the required objects to sp_buffer
-    This is esentially OAM scan for the current scanline
-    */
-    for (int i = 0; i < 40 && obj_count < 10; i++) {
-        if(oam[i].x <= 0) continue;
-        if(ppu->ly+16 < oam[i].y) continue;
-        if(ppu->ly + 16 >= oam[i].y + obj_height) continue;
-        sp_buffer[obj_count++] = oam[i];
-    }
+static void render_objects(const LineState *line, const TileSource *src, const uint8_t *ids, uint8_t *shades){
 
-    // Sort the objects by x coordinate increasing priority
-    ins_sort_obj(sp_buffer, obj_count);
-    //printf("%u objects in scanline no: %u\n", obj_count, ppu->ly);
+    if (!(line->regs.lcdc & 0x02)) return; // Sprites disabled
+    uint8_t obj_height = (line->regs.lcdc & 0x04) ? 16 : 8;
+
+    //the objects on this line, copied out of oam. each object has the four properties of the Sprite struct
+    //printf("%u objects in scanline no: %u\n", line->obj_count, line->ly);
     
-    for(int i=obj_count-1; i>=0; i--){
-        Sprite curr_sprite = sp_buffer[i];
+    for(int i=line->obj_count-1; i>=0; i--){
+        Sprite curr_sprite = line->objs[i];
         
         // select the obp and flip from flags
         uint8_t palette_num = (curr_sprite.flags & 0x10) ? 1 : 0;
-        uint8_t palette = palette_num ? ppu->obp1 : ppu->obp0;
+        uint8_t palette = palette_num ? line->regs.obp1 : line->regs.obp0;
         bool y_flip = (curr_sprite.flags & 0x40);
         bool x_flip = (curr_sprite.flags & 0x20);
         //bool priority = (curr_sprite.flags & 0x80);
 
-        uint8_t tile_y = (ppu->ly - curr_sprite.y + 16);
+        uint8_t tile_y = (line->ly - curr_sprite.y + 16);
 
         if (y_flip) {
             tile_y = obj_height - 1 - tile_y;
@@ -360,18 +631,11 @@ void render_objects(PPU *ppu, CPU *cpu){
                 tile_y -= 8;
             }
         }
-        uint16_t tile_addr = 0x8000 + (tile_index * 16) + (tile_y * 2);
-
-        // This is pixel data (2bpp)
-        uint8_t bytelo = read8(cpu, tile_addr);
-        uint8_t bytehi = read8(cpu, tile_addr + 1);
+        // Objects always use the 0x8000 tiles, the flipped copy saves mirroring every pixel
+        const uint8_t *row = x_flip ? src->tiles_xflip[tile_index][tile_y] : src->tiles[tile_index][tile_y];
 
         for(int j=0;  j<8; j++){
-            int pixel_index = x_flip ? 7 - j : j;  
-            // we need msb to get the colours     
-            uint8_t colour_bit1 = (bytelo >> (7 - pixel_index)) & 1;
-            uint8_t colour_bit2 = (bytehi >> (7 - pixel_index)) & 1;
-            uint8_t colour_id = (colour_bit2 << 1) | colour_bit1;
+            uint8_t colour_id = row[j];
 
             if (colour_id == 0) continue;
 
@@ -380,20 +644,198 @@ void render_objects(PPU *ppu, CPU *cpu){
             if (screen_x < 0 || screen_x >= 160) continue;
             // --------------------------------------------------------
 
-            bool bg_priority = (curr_sprite.flags & 0x80) && (bg_indices[screen_x] != 0);
+            bool bg_priority = (curr_sprite.flags & 0x80) && (ids[screen_x] != 0);
             if(!bg_priority){
-                uint32_t index = ppu->ly * SCREEN_WIDTH + screen_x;
-                uint8_t shade_index = (palette >> (colour_id * 2)) & 0x03;
-                //if(priority && ppu->framebuffer[index] != GAMEBOY_COLOURS[0]) continue;
-                ppu->framebuffer[index] = GAMEBOY_COLOURS[shade_index];
+                shades[screen_x] = (palette >> (colour_id * 2)) & 0x03;
+            }
+
+        }
+    }
+}
+
+/* Mode 3 length, from Pan Docs: 172 dots, plus the SCX fine scroll that gets thrown away,
+   6 for the window restarting the fetcher and 6 to 11 for every object. */
+static int mode3_length(PPU *ppu, CPU *cpu) {
+    int length = 172 + (ppu->scx & 7);
+
+    bool window = (ppu->lcdc & 0x20) && (ppu->wly_latch || ppu->ly == ppu->wy) && ppu->wx < 166;
+    if (window)
+        length += 6;
+
+    if (ppu->lcdc & 0x02) {
+        const Sprite *oam = (const Sprite *)&cpu->memory[0xFE00];
+        const uint8_t *line_objs = ppu->line_objs[ppu->ly];
+        int last_tile = -1;
+        for (int i = 0; i < ppu->line_obj_count[ppu->ly]; i++) {
+            length += 6;
+            // the first object in a background tile also waits for that tile's fetch
+            int pos = oam[line_objs[i]].x + (ppu->scx & 7);
+            if (pos / 8 != last_tile) {
+                length += (pos % 8) < 5 ? 5 - (pos % 8) : 0;
+                last_tile = pos / 8;
             }
+        }
+    }
+    return length > 289 ? 289 : length;
+}
+
+// OAM scan is over: fix what the line starts with and how long drawing takes
+static void start_mode3(PPU *ppu, CPU *cpu) {
+    if (cpu->dma_active)
+        dma_sync(cpu);
+    if (ppu->oam_dirty)
+        build_line_objects(ppu, cpu);
+
+    ppu->line_regs = (LineRegs){ ppu->lcdc, ppu->scy, ppu->scx, ppu->bgp,
+                                 ppu->obp0, ppu->obp1, ppu->wy, ppu->wx };
+    ppu->mode3_log_len = 0;
+    ppu->mode3_length = ppu->ly < SCREEN_HEIGHT ? mode3_length(ppu, cpu) : 172;
+}
+
+/* Fixes what the current line is drawn from. The window latch and line counter
+   move on here, whether the line gets drawn, reused or skipped. */
+static void line_state(PPU *ppu, CPU *cpu, LineState *line) {
+    if (ppu->ly == ppu->wy)
+        ppu->wly_latch = true;
 
+    memset(line, 0, sizeof(*line));
+    line->regs = ppu->line_regs;
+    line->ly = ppu->ly;
+    line->wly = ppu->wly;
+    line->window = (ppu->lcdc & 0x20) && ppu->wly_latch && ppu->wx < 166;
+
+    if (ppu->lcdc & 0x02) {
+        const Sprite *oam = (const Sprite *)&cpu->memory[0xFE00];
+        line->obj_count = ppu->line_obj_count[ppu->ly];
+        for (int i = 0; i < line->obj_count; i++) {
+            line->obj_index[i] = ppu->line_objs[ppu->ly][i];
+            line->objs[i] = oam[line->obj_index[i]];
         }
     }
+
+    if (line->window)
+        ppu->wly += 1;
+}
+
+// The fast path: a whole line of bg, window and objects into shades (160 of them)
+void draw_line(const LineState *line, const TileSource *src, uint8_t *shades) {
+    if (src->vram1) {
+        draw_line_cgb(line, src, shades);
+        return;
+    }
+    uint8_t ids[SCREEN_WIDTH];
+    render_bg(line, src, ids, shades);
+    render_objects(line, src, ids, shades);
+}
+
+// What the fast path is going to draw the current line from
+static void make_line_key(PPU *ppu, const LineState *line, const uint32_t *colours, LineKey *key) {
+    uint8_t lcdc = line->regs.lcdc;
+    memset(key, 0, sizeof(*key));
+    key->line = *line;
+    key->colours = ppu->indexed ? NULL : colours;
+    key->palette_gen = ppu->palette_gen; // never moves on DMG
+    // LCDC bit 0 doesn't hide the bg on CGB
+    bool bg = (lcdc & 0x01) || ppu->cgb;
+    bool blocks[3] = { false, false, false };
+
+    // the bg and window share the tile blocks, $8000 unsigned or $9000 signed
+    if (bg || line->window) {
+        blocks[1] = true;
+        blocks[(lcdc & 0x10) ? 0 : 2] = true;
+    }
+    if (bg)
+        key->bg_map_gen = ppu->map_gen[(lcdc >> 3) & 1][(uint8_t)(line->regs.scy + line->ly) / 8];
+    if (line->window)
+        key->win_map_gen = ppu->map_gen[(lcdc >> 6) & 1][line->wly / 8];
+
+    // objects always use $8000-$8FFF
+    if (line->obj_count > 0)
+        blocks[0] = blocks[1] = true;
+
+    // on CGB any of them can also come out of bank 1
+    for (int b = 0; b < 3; b++) {
+        if (!blocks[b])
+            continue;
+        key->tile_gen[b] = ppu->tile_gen[b];
+        if (ppu->cgb)
+            key->tile_gen[b + 3] = ppu->tile_gen[b + 3];
+    }
+}
+
+// Takes the current line from the last published frame, it was drawn from the same key
+static void reuse_scanline(PPU *ppu) {
+    uint32_t offset = ppu->ly * SCREEN_WIDTH;
+    const Frame *last = &ppu->frames[ppu->published];
+    memcpy(&ppu->shades[offset], &last->shades[offset], SCREEN_WIDTH);
+    if (!ppu->indexed)
+        memcpy(&ppu->framebuffer[offset], &last->pixels[offset], SCREEN_WIDTH * sizeof(uint32_t));
 }
 
 void render_scanline(PPU *ppu, CPU *cpu) {
     if (!(ppu->lcdc & 0x80)) return; // LCD disabled
-    render_bg(ppu, cpu);
-    render_objects(ppu, cpu);
-}
\ No newline at end of file
+    if (cpu->dma_active)
+        dma_sync(cpu);
+    if (ppu->oam_dirty)
+        build_line_objects(ppu, cpu);
+
+    // only lines that changed registers mid-way need the slow, exact renderer
+    bool fifo = ppu->mode3_log_len > 0 || ppu->fifo_always;
+    LineState line;
+
+    if (ppu->skip_frame) {
+        // mid-line writes can start the window anywhere, the FIFO still runs to get the counter right
+        static uint8_t discarded[SCREEN_WIDTH];
+        if (fifo)
+            render_scanline_fifo(ppu, cpu, discarded);
+        else
+            line_state(ppu, cpu, &line);
+        return;
+    }
+
+    // -renderthreads: the line only gets written down, the render thread draws the frame
+    if (render_enabled) {
+        render_begin_frame(cpu);
+        if (fifo)
+            render_scanline_fifo(ppu, cpu, render_fifo_line(ppu->ly));
+        else
+            line_state(ppu, cpu, &line);
+        render_record_line(ppu->ly, fifo ? NULL : &line);
+        ppu->lines_drawn++;
+        return;
+    }
+
+    uint8_t *shades = &ppu->shades[ppu->ly * SCREEN_WIDTH];
+    const uint32_t *colours = GAMEBOY_COLOURS; // the key and the pixels have to agree
+    ppu->line_reused[ppu->ly] = false;
+
+    if (fifo) {
+        render_scanline_fifo(ppu, cpu, shades);
+        ppu->line_key_valid[ppu->ly] = false;
+    }
+    else {
+        LineKey key;
+        line_state(ppu, cpu, &line);
+        make_line_key(ppu, &line, colours, &key);
+        if (ppu->line_key_valid[ppu->ly] && memcmp(&key, &ppu->line_keys[ppu->ly], sizeof(key)) == 0) {
+            reuse_scanline(ppu);
+            ppu->line_reused[ppu->ly] = true;
+            ppu->lines_reused++;
+            return;
+        }
+        TileSource src = { &cpu->memory[0x8000], ppu->tiles, ppu->tiles_xflip, ppu->use_layers ? cpu : NULL,
+                           ppu->cgb ? ppu->vram1 : NULL };
+        draw_line(&line, &src, shades);
+        ppu->line_keys[ppu->ly] = key;
+        ppu->line_key_valid[ppu->ly] = true;
+    }
+    ppu->lines_drawn++;
+
+    if (!ppu->indexed) {
+        uint32_t offset = ppu->ly * SCREEN_WIDTH;
+        if (ppu->cgb)
+            cgb_to_argb(ppu, &ppu->shades[offset], &ppu->framebuffer[offset], SCREEN_WIDTH);
+        else
+            pixel_to_argb(&ppu->shades[offset], &ppu->framebuffer[offset], colours, SCREEN_WIDTH);
+    }
+}
@@ -0,0 +1,198 @@
+#include "cpu.h"
+#include "render.h"
+
+/* Game Boy Color rendering
+    Used instead of render_bg + render_objects once the cartridge asks for CGB
+    mode (see cgb_start in mem.c). What changes:
+      - VRAM bank 1 holds another 384 tiles and an attribute byte for every map
+        entry: palette (0-2), tile bank (3), X/Y flip (5, 6), priority over objects (7)
+      - 8 bg and 8 object palettes of 4 RGB555 colours, written through
+        BCPS/BCPD and OCPS/OCPD, rather than BGP/OBP0/OBP1
+      - objects take their palette (0-2) and tile bank (3) from the flags,
+        and the one earlier in OAM wins, not the one further left
+      - LCDC bit 0 no longer hides the bg, it takes priority away from
+        everything bg so objects end up on top
+
+    A shade here is (object << 5) | (palette << 2) | colour id, an index into
+    cgb_colours. Everything else about a line (LineState, the memo keys,
+    the FIFO) works the same as on DMG.
+*/
+
+#define OBJ_SHADES 0x20
+
+// 5 bits per channel to 8: the top bits repeat in the bottom ones so 31 is 255
+static uint32_t rgb555_to_argb(uint16_t colour) {
+    uint32_t r = colour & 0x1F;
+    uint32_t g = (colour >> 5) & 0x1F;
+    uint32_t b = (colour >> 10) & 0x1F;
+    r = (r << 3) | (r >> 2);
+    g = (g << 3) | (g >> 2);
+    b = (b << 3) | (b >> 2);
+    return 0xFF000000 | (r << 16) | (g << 8) | b;
+}
+
+void ppu_cgb_init(PPU *ppu) {
+    ppu->cgb = true;
+    // the shades aren't 0-3 anymore, and the layers know nothing about attributes
+    ppu->indexed = false;
+    ppu->use_layers = false;
+    // a ROM loaded from the UI: the core isn't running yet, no frame is on its way
+    if (render_enabled)
+        render_stop();
+    ppu->vbk = 0;
+    ppu->bcps = ppu->ocps = 0;
+    memset(ppu->vram1, 0, sizeof(ppu->vram1));
+
+    // the boot ROM leaves every palette white
+    for (int i = 0; i < 64; i += 2) {
+        ppu->bg_palettes[i] = ppu->obj_palettes[i] = 0xFF;
+        ppu->bg_palettes[i + 1] = ppu->obj_palettes[i + 1] = 0x7F;
+    }
+    for (int i = 0; i < 64; i++)
+        ppu->cgb_colours[i] = 0xFFFFFFFF;
+    ppu->palette_gen = 0;
+
+    for (int f = 0; f < 3; f++)
+        for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++)
+            ppu->frames[f].pixels[i] = 0xFFFFFFFF;
+    memset(ppu->line_key_valid, 0, sizeof(ppu->line_key_valid));
+}
+
+uint8_t ppu_cgb_read(CPU *cpu, uint16_t addr) {
+    PPU *ppu = &cpu->ppu;
+    switch (addr) {
+        case 0xFF4F: return ppu->vbk | 0xFE;
+        case 0xFF68: return ppu->bcps | 0x40;
+        case 0xFF69: return ppu->bg_palettes[ppu->bcps & 0x3F];
+        case 0xFF6A: return ppu->ocps | 0x40;
+        case 0xFF6B: return ppu->obj_palettes[ppu->ocps & 0x3F];
+    }
+    return 0xFF;
+}
+
+// A write to BCPD/OCPD: palette RAM at *index, which moves on if bit 7 says so
+static void write_palette(PPU *ppu, uint8_t *palettes, uint8_t *index, int first_colour, uint8_t value) {
+    uint8_t byte = *index & 0x3F;
+    if (palettes[byte] != value) {
+        palettes[byte] = value;
+        uint16_t colour = palettes[byte & ~1] | (palettes[byte | 1] << 8);
+        ppu->cgb_colours[first_colour + byte / 2] = rgb555_to_argb(colour);
+        ppu->palette_gen++;
+    }
+    if (*index & 0x80)
+        *index = 0x80 | ((byte + 1) & 0x3F);
+}
+
+void ppu_cgb_write(CPU *cpu, uint16_t addr, uint8_t value) {
+    PPU *ppu = &cpu->ppu;
+    switch (addr) {
+        case 0xFF4F:
+            // an OAM DMA from VRAM reads the bank that's mapped, up to now that's the old one
+            if (cpu->dma_active)
+                dma_sync(cpu);
+            ppu->vbk = value & 0x01;
+            break;
+        case 0xFF68: ppu->bcps = value & 0xBF; break;
+        case 0xFF69: write_palette(ppu, ppu->bg_palettes, &ppu->bcps, 0, value); break;
+        case 0xFF6A: ppu->ocps = value & 0xBF; break;
+        case 0xFF6B: write_palette(ppu, ppu->obj_palettes, &ppu->ocps, 32, value); break;
+    }
+}
+
+// Shades to pixels, pixel_to_argb only knows 4 colour tables
+void cgb_to_argb(const PPU *ppu, const uint8_t *shades, uint32_t *out, int n) {
+    for (int i = 0; i < n; i++)
+        out[i] = ppu->cgb_colours[shades[i] & 0x3F];
+}
+
+/* render_tile_row with attributes: colour ids [start, end) of a line, and the
+   attribute byte of the tile every pixel came from */
+static void render_attr_row(const TileSource *src, uint8_t *ids, uint8_t *attrs, uint8_t lcdc, uint16_t map_base, uint8_t map_x, uint8_t map_y, int start, int end) {
+    uint16_t map_row = map_base - 0x8000 + (map_y / 8) * 32;
+    int i = start;
+    while (i < end) {
+        uint16_t entry = map_row + map_x / 8;
+        uint8_t tile_number = src->vram[entry];
+        uint8_t attr = src->vram1[entry];
+        uint16_t tile = (lcdc & 0x10) ? tile_number : 256 + (int8_t)tile_number;
+        if (attr & 0x08)
+            tile += 384;
+        uint8_t tile_line = (attr & 0x40) ? 7 - map_y % 8 : map_y % 8;
+        const uint8_t *row = (attr & 0x20) ? src->tiles_xflip[tile][tile_line] : src->tiles[tile][tile_line];
+
+        int x = map_x % 8;
+        int count = (8 - x < end - i) ? 8 - x : end - i;
+        memcpy(&ids[i], &row[x], count);
+        memset(&attrs[i], attr, count);
+        i += count;
+        map_x += count;
+    }
+}
+
+static void render_objects_cgb(const LineState *line, const TileSource *src, const uint8_t *ids, const uint8_t *attrs, uint8_t *shades) {
+    uint8_t lcdc = line->regs.lcdc;
+    if (!(lcdc & 0x02)) return;
+    uint8_t obj_height = (lcdc & 0x04) ? 16 : 8;
+    // LCDC bit 0 clear: objects go over the bg whatever it or they say
+    bool bg_priority = lcdc & 0x01;
+
+    // OAM order, a pixel taken by an object stays its even if the bg covers it
+    uint8_t order[10];
+    for (int i = 0; i < line->obj_count; i++) {
+        int j = i;
+        for (; j > 0 && line->obj_index[order[j - 1]] > line->obj_index[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+    bool taken[SCREEN_WIDTH] = { false };
+
+    for (int n = 0; n < line->obj_count; n++) {
+        const Sprite *obj = &line->objs[order[n]];
+        uint8_t tile_y = line->ly - obj->y + 16;
+        if (obj->flags & 0x40)
+            tile_y = obj_height - 1 - tile_y;
+
+        uint16_t tile = obj->tile_index;
+        if (obj_height == 16) {
+            tile = (tile_y < 8) ? (tile & 0xFE) : (tile | 0x01);
+            tile_y &= 7;
+        }
+        if (obj->flags & 0x08)
+            tile += 384;
+        const uint8_t *row = (obj->flags & 0x20) ? src->tiles_xflip[tile][tile_y] : src->tiles[tile][tile_y];
+        uint8_t palette = OBJ_SHADES | ((obj->flags & 0x07) << 2);
+
+        for (int j = 0; j < 8; j++) {
+            int screen_x = obj->x - 8 + j;
+            if (screen_x < 0 || screen_x >= SCREEN_WIDTH || row[j] == 0 || taken[screen_x])
+                continue;
+            taken[screen_x] = true;
+            bool behind = bg_priority && ids[screen_x] != 0 && ((attrs[screen_x] & 0x80) || (obj->flags & 0x80));
+            if (!behind)
+                shades[screen_x] = palette | row[j];
+        }
+    }
+}
+
+// draw_line for CGB mode
+void draw_line_cgb(const LineState *line, const TileSource *src, uint8_t *shades) {
+    const LineRegs *regs = &line->regs;
+    uint8_t ids[SCREEN_WIDTH], attrs[SCREEN_WIDTH];
+    uint16_t bg_map_base = (regs->lcdc & 0x08) ? 0x9C00 : 0x9800;
+    uint16_t window_map_base = (regs->lcdc & 0x40) ? 0x9C00 : 0x9800;
+
+    int window_start = SCREEN_WIDTH;
+    if (line->window)
+        window_start = (regs->wx < 7) ? 0 : regs->wx - 7;
+
+    render_attr_row(src, ids, attrs, regs->lcdc, bg_map_base, regs->scx, regs->scy + line->ly, 0, window_start);
+    if (line->window) {
+        uint8_t window_x = window_start - (regs->wx - 7);
+        render_attr_row(src, ids, attrs, regs->lcdc, window_map_base, window_x, line->wly, window_start, SCREEN_WIDTH);
+    }
+
+    for (int i = 0; i < SCREEN_WIDTH; i++)
+        shades[i] = ((attrs[i] & 0x07) << 2) | ids[i];
+
+    render_objects_cgb(line, src, ids, attrs, shades);
+}
@@ -0,0 +1,219 @@
+#include "cpu.h"
+
+/* Pixel FIFO renderer
+    Draws one line the way the hardware does during mode 3, a dot at a time:
+    the fetcher reads a tile every 8 dots (map entry, low, high, push) into
+    the background FIFO, objects stall it while they are fetched into the
+    object FIFO, and one pixel leaves per dot. Register writes logged during
+    mode 3 are replayed at the dot they happened, so mid-line SCX, BGP,
+    LCDC and window changes land on the right pixel.
+
+    It's much slower than render_bg + render_objects, render_scanline only
+    uses it on lines that had such writes (or with -fifo).
+
+    In CGB mode the fetcher also reads the tile's attributes out of VRAM bank 1
+    and the shades come out the way ppu_cgb.c makes them.
+*/
+
+enum { FETCH_TILE, FETCH_LOW, FETCH_HIGH, FETCH_PUSH };
+
+#define OBJ_FETCH_DOTS 6
+#define MAX_LINE_DOTS 456 // way past anything mode 3 can take, in case something goes wrong
+
+typedef struct {
+    uint8_t colour;   // 0 is transparent
+    uint8_t palette;  // 0 = OBP0, 1 = OBP1, CGB: 0-7
+    bool behind_bg;   // OBJ-to-BG priority
+    uint8_t index;    // in OAM, on CGB the lower one wins
+} ObjPixel;
+
+static void apply_write(LineRegs *regs, const RegWrite *w) {
+    switch (w->reg) {
+        case 0x40: regs->lcdc = w->value; break;
+        case 0x42: regs->scy  = w->value; break;
+        case 0x43: regs->scx  = w->value; break;
+        case 0x47: regs->bgp  = w->value; break;
+        case 0x48: regs->obp0 = w->value; break;
+        case 0x49: regs->obp1 = w->value; break;
+        case 0x4A: regs->wy   = w->value; break;
+        case 0x4B: regs->wx   = w->value; break;
+    }
+}
+
+/* Puts an object's row into the object FIFO, pixels already there (earlier objects) win.
+   On CGB only if they are earlier in OAM too. */
+static void fetch_object(PPU *ppu, const LineRegs *regs, const Sprite *obj, uint8_t index, int lx, ObjPixel fifo[8]) {
+    uint8_t obj_height = (regs->lcdc & 0x04) ? 16 : 8;
+    uint8_t tile_y = ppu->ly - obj->y + 16;
+    if (obj->flags & 0x40)
+        tile_y = obj_height - 1 - tile_y;
+
+    uint16_t tile_index = obj->tile_index;
+    if (obj_height == 16) {
+        tile_index = (tile_y < 8) ? (tile_index & 0xFE) : (tile_index | 0x01);
+        tile_y &= 7;
+    }
+    // a line list built for 8x16 objects can still hold one that is 8x8 by now
+    if (tile_y > 7)
+        return;
+    if (ppu->cgb && (obj->flags & 0x08))
+        tile_index += 384;
+
+    const uint8_t *row = (obj->flags & 0x20) ? ppu->tiles_xflip[tile_index][tile_y] : ppu->tiles[tile_index][tile_y];
+    int start = obj->x - 8;
+
+    for (int j = 0; j < 8; j++) {
+        int slot = start + j - lx;
+        if (slot < 0 || slot > 7) continue; // off the left edge
+        if (row[j] == 0) continue;
+        if (fifo[slot].colour != 0 && (!ppu->cgb || fifo[slot].index < index)) continue;
+        fifo[slot].colour = row[j];
+        fifo[slot].palette = ppu->cgb ? (obj->flags & 0x07) : (obj->flags & 0x10) ? 1 : 0;
+        fifo[slot].behind_bg = (obj->flags & 0x80) != 0;
+        fifo[slot].index = index;
+    }
+}
+
+// Draws the current line into line (160 shades)
+void render_scanline_fifo(PPU *ppu, CPU *cpu, uint8_t *line) {
+    LineRegs regs = ppu->line_regs;
+    int next_write = 0;
+
+    const Sprite *oam = (const Sprite *)&cpu->memory[0xFE00];
+    const uint8_t *line_objs = ppu->line_objs[ppu->ly];
+    int obj_count = ppu->line_obj_count[ppu->ly];
+    int next_obj = 0;
+
+    if (ppu->ly == regs.wy)
+        ppu->wly_latch = true;
+
+    // background FIFO, only refilled once empty so 8 is enough
+    uint8_t bg_fifo[8];
+    uint8_t bg_attr = 0; // CGB, of the tile in the FIFO
+    int bg_len = 0, bg_pos = 0;
+    ObjPixel obj_fifo[8];
+    memset(obj_fifo, 0, sizeof(obj_fifo));
+
+    int fetch_state = FETCH_TILE;
+    int fetch_dots = 0;
+    int fetch_x = 0;       // tile column, counted from SCX / the window's left edge
+    uint8_t fetch_tile = 0, fetch_row = 0, fetch_attr = 0;
+    bool in_window = false;
+    int stall = 0;
+
+    int discard = regs.scx & 7; // fine scroll, these pixels are fetched but never shown
+    int lx = 0;
+
+    for (int dot = 0; lx < SCREEN_WIDTH && dot < MAX_LINE_DOTS; dot++) {
+        while (next_write < ppu->mode3_log_len && ppu->mode3_log[next_write].dot <= dot)
+            apply_write(&regs, &ppu->mode3_log[next_write++]);
+
+        // Window: the fetcher starts over from the window map once WX-7 is reached
+        if (!in_window && (regs.lcdc & 0x20) && ppu->wly_latch && regs.wx < 166 && lx >= regs.wx - 7) {
+            in_window = true;
+            bg_len = 0;
+            fetch_state = FETCH_TILE;
+            fetch_dots = 0;
+            fetch_x = 0;
+            discard = regs.wx < 7 ? 7 - regs.wx : 0;
+        }
+
+        // Objects: fetched once the line reaches them, the background waits meanwhile
+        if (stall == 0 && discard == 0 && next_obj < obj_count && oam[line_objs[next_obj]].x - 8 <= lx) {
+            if (regs.lcdc & 0x02) {
+                fetch_object(ppu, &regs, &oam[line_objs[next_obj]], line_objs[next_obj], lx, obj_fifo);
+                stall = OBJ_FETCH_DOTS;
+            }
+            next_obj++;
+        }
+        if (stall > 0) {
+            stall--;
+            continue;
+        }
+
+        // Fetcher: 2 dots for every step but the push, which retries until the FIFO is empty
+        if (fetch_state != FETCH_PUSH && ++fetch_dots < 2) {
+            // still busy with this step
+        }
+        else {
+            fetch_dots = 0;
+            switch (fetch_state) {
+            case FETCH_TILE: {
+                uint16_t map_addr;
+                if (in_window) {
+                    uint16_t map_base = (regs.lcdc & 0x40) ? 0x9C00 : 0x9800;
+                    map_addr = map_base + (ppu->wly / 8) * 32 + (fetch_x & 31);
+                    fetch_row = ppu->wly % 8;
+                }
+                else {
+                    uint16_t map_base = (regs.lcdc & 0x08) ? 0x9C00 : 0x9800;
+                    uint8_t y = regs.scy + ppu->ly;
+                    map_addr = map_base + (y / 8) * 32 + (((regs.scx / 8) + fetch_x) & 31);
+                    fetch_row = y % 8;
+                }
+                fetch_tile = cpu->memory[map_addr];
+                fetch_attr = ppu->cgb ? ppu->vram1[map_addr - 0x8000] : 0;
+                fetch_state = FETCH_LOW;
+                break;
+            }
+            case FETCH_LOW:
+                fetch_state = FETCH_HIGH;
+                break;
+            case FETCH_HIGH:
+                fetch_state = FETCH_PUSH;
+                break;
+            case FETCH_PUSH:
+                if (bg_len == 0) {
+                    // $8000 unsigned or $9000 signed, whatever LCDC says right now
+                    uint16_t tile = (regs.lcdc & 0x10) ? fetch_tile : 256 + (int8_t)fetch_tile;
+                    uint8_t row = fetch_row;
+                    if (fetch_attr & 0x08) tile += 384;
+                    if (fetch_attr & 0x40) row = 7 - row;
+                    memcpy(bg_fifo, (fetch_attr & 0x20) ? ppu->tiles_xflip[tile][row] : ppu->tiles[tile][row], 8);
+                    bg_attr = fetch_attr;
+                    bg_len = 8;
+                    bg_pos = 0;
+                    fetch_x++;
+                    fetch_state = FETCH_TILE;
+                }
+                break;
+            }
+        }
+
+        // One pixel out per dot
+        if (bg_len == 0)
+            continue;
+        uint8_t bg_id = bg_fifo[bg_pos++];
+        bg_len--;
+        if (discard > 0) {
+            discard--;
+            continue;
+        }
+        if (!(regs.lcdc & 0x01) && !in_window && !ppu->cgb)
+            bg_id = 0;
+
+        ObjPixel obj = obj_fifo[0];
+        memmove(obj_fifo, obj_fifo + 1, sizeof(ObjPixel) * 7);
+        memset(&obj_fifo[7], 0, sizeof(ObjPixel));
+
+        if (ppu->cgb) {
+            // LCDC bit 0 clear puts objects over everything
+            bool behind = (regs.lcdc & 0x01) && bg_id != 0 && ((bg_attr & 0x80) || obj.behind_bg);
+            if (obj.colour && (regs.lcdc & 0x02) && !behind)
+                line[lx] = 0x20 | (obj.palette << 2) | obj.colour;
+            else
+                line[lx] = ((bg_attr & 0x07) << 2) | bg_id;
+        }
+        else if (obj.colour && (regs.lcdc & 0x02) && !(obj.behind_bg && bg_id != 0)) {
+            uint8_t palette = obj.palette ? regs.obp1 : regs.obp0;
+            line[lx] = (palette >> (obj.colour * 2)) & 0x03;
+        }
+        else {
+            line[lx] = (regs.bgp >> (bg_id * 2)) & 0x03;
+        }
+        lx++;
+    }
+
+    if (in_window)
+        ppu->wly += 1;
+}
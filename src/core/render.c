@@ -0,0 +1,302 @@
+#include "render.h"
+#include "emu.h"
+#include "pixel.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Render thread and its workers, see render.h.
+   The render thread is worker 0, it hands the other slices out, draws its own
+   and publishes the frame once every slice is done. */
+
+#define MAX_RENDER_THREADS 8
+#define VRAM_LOG_SIZE 16384 // twice all of VRAM, a frame that writes more gets dropped
+
+typedef struct {
+    uint16_t addr;  // offset from $8000
+    uint8_t value;
+    uint8_t line;   // the line drawn next when it was written
+} VramWrite;
+
+typedef struct {
+    uint8_t vram[0x2000]; // when the first line was drawn
+    VramWrite log[VRAM_LOG_SIZE];
+    int log_len;
+    bool overflow;
+    bool open;            // the frame's first line has been recorded, the frame isn't done yet
+    int lines;            // up to the last line recorded
+    LineState line[SCREEN_HEIGHT];
+    bool fifo[SCREEN_HEIGHT]; // drawn by the core already, into shades
+    uint8_t shades[SCREEN_WIDTH * SCREEN_HEIGHT];
+    const uint32_t *colours;
+    bool indexed;
+    bool blank;           // lcd off, the frame is all white
+    uint32_t period;      // the PPU's frame period when it was handed over
+} FrameRecord;
+
+// A worker keeps its own VRAM and tile cache, brought up to date with the log as it goes
+typedef struct {
+    SDL_Thread *thread;
+    SDL_sem *go;
+    int first, last; // lines [first, last)
+    uint8_t vram[0x2000];
+    uint8_t tiles[384][8][8];
+    uint8_t tiles_xflip[384][8][8];
+} Worker;
+
+bool render_enabled = false;
+
+static PPU *render_ppu;
+static FrameRecord records[2];
+static FrameRecord *recording = &records[0]; // core side
+static FrameRecord *drawing = NULL;          // render thread side
+static bool shown_blank = false;
+
+static Worker *workers = NULL;
+static int worker_count = 0;
+static SDL_Thread *render_thread = NULL;
+static SDL_sem *frame_ready = NULL; // core -> render thread
+static SDL_sem *slice_done = NULL;  // workers -> render thread
+static SDL_atomic_t busy;           // the render thread has a frame
+static SDL_atomic_t stopping;
+
+static void draw_slice(Worker *w, const FrameRecord *rec, Frame *out) {
+    memcpy(w->vram, rec->vram, sizeof(w->vram));
+    pixel_decode_2bpp(w->vram, &w->tiles[0][0][0], 384 * 8);
+    for (int t = 0; t < 384; t++)
+        for (int y = 0; y < 8; y++)
+            for (int x = 0; x < 8; x++)
+                w->tiles_xflip[t][y][7 - x] = w->tiles[t][y][x];
+
+    TileSource src = { w->vram, w->tiles, w->tiles_xflip, NULL, NULL };
+    int next = 0;
+    for (int ly = w->first; ly < w->last; ly++) {
+        // VRAM as the core saw it when it got to this line
+        for (; next < rec->log_len && rec->log[next].line <= ly; next++) {
+            const VramWrite *write = &rec->log[next];
+            w->vram[write->addr] = write->value;
+            if (write->addr < 0x1800)
+                decode_tile_row(w->vram, w->tiles, w->tiles_xflip, write->addr);
+        }
+
+        uint8_t *shades = &out->shades[ly * SCREEN_WIDTH];
+        if (rec->fifo[ly])
+            memcpy(shades, &rec->shades[ly * SCREEN_WIDTH], SCREEN_WIDTH);
+        else
+            draw_line(&rec->line[ly], &src, shades);
+        if (!rec->indexed)
+            pixel_to_argb(shades, &out->pixels[ly * SCREEN_WIDTH], rec->colours, SCREEN_WIDTH);
+    }
+}
+
+static int worker_main(void *data) {
+    Worker *w = (Worker *)data;
+    for (;;) {
+        SDL_SemWait(w->go);
+        if (SDL_AtomicGet(&stopping))
+            break;
+        draw_slice(w, drawing, &render_ppu->frames[render_ppu->back]);
+        SDL_SemPost(slice_done);
+    }
+    return 0;
+}
+
+static int render_main(void *data) {
+    (void)data;
+    for (;;) {
+        SDL_SemWait(frame_ready);
+        if (SDL_AtomicGet(&stopping))
+            break;
+
+        const FrameRecord *rec = drawing;
+        Frame *out = &render_ppu->frames[render_ppu->back];
+        if (rec->blank) {
+            memset(out->shades, 0, sizeof(out->shades));
+            for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT && !rec->indexed; i++)
+                out->pixels[i] = rec->colours[0];
+        }
+        else {
+            for (int i = 1; i < worker_count; i++)
+                SDL_SemPost(workers[i].go);
+            draw_slice(&workers[0], rec, out);
+            for (int i = 1; i < worker_count; i++)
+                SDL_SemWait(slice_done);
+        }
+        ppu_publish_frame(render_ppu, rec->period);
+        SDL_AtomicSet(&busy, 0);
+    }
+    return 0;
+}
+
+bool render_start(PPU *ppu, int threads) {
+    // the records know nothing about VRAM bank 1 or colour palettes
+    if (ppu->cgb) {
+        printf("-renderthreads doesn't do CGB mode, drawing on the core\n");
+        return false;
+    }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_RENDER_THREADS) threads = MAX_RENDER_THREADS;
+
+    workers = calloc(threads, sizeof(Worker));
+    frame_ready = SDL_CreateSemaphore(0);
+    slice_done = SDL_CreateSemaphore(0);
+    if (!workers || !frame_ready || !slice_done) {
+        printf("Error: Could not set up the render thread\n");
+        render_stop();
+        return false;
+    }
+
+    render_ppu = ppu;
+    worker_count = threads;
+    SDL_AtomicSet(&busy, 0);
+    SDL_AtomicSet(&stopping, 0);
+    for (int i = 0; i < threads; i++) {
+        workers[i].first = SCREEN_HEIGHT * i / threads;
+        workers[i].last = SCREEN_HEIGHT * (i + 1) / threads;
+        if (i > 0) {
+            workers[i].go = SDL_CreateSemaphore(0);
+            if (workers[i].go)
+                workers[i].thread = SDL_CreateThread(worker_main, "admgeRenderWorker", &workers[i]);
+            if (!workers[i].thread) {
+                printf("Error: Could not start render worker %d, drawing on the core\n", i);
+                render_stop();
+                return false;
+            }
+        }
+    }
+    render_thread = SDL_CreateThread(render_main, "admgeRender", NULL);
+    if (!render_thread) {
+        printf("Error: Could not start the render thread, drawing on the core\n");
+        render_stop();
+        return false;
+    }
+
+    render_enabled = true;
+    printf("Rendering on %d thread%s\n", threads, threads > 1 ? "s" : "");
+    return true;
+}
+
+// Only once the core has stopped, nothing may hand over frames anymore
+void render_stop(void) {
+    // a frame being drawn needs every worker, let it finish first
+    while (render_thread && SDL_AtomicGet(&busy))
+        SDL_Delay(1);
+    // also what a half done render_start cleans up with, workers may run without a render thread
+    SDL_AtomicSet(&stopping, 1);
+    if (render_thread) {
+        SDL_SemPost(frame_ready);
+        SDL_WaitThread(render_thread, NULL);
+        render_thread = NULL;
+    }
+    for (int i = 1; workers && i < worker_count; i++) {
+        if (workers[i].thread) {
+            SDL_SemPost(workers[i].go);
+            SDL_WaitThread(workers[i].thread, NULL);
+        }
+        if (workers[i].go)
+            SDL_DestroySemaphore(workers[i].go);
+    }
+    if (frame_ready) SDL_DestroySemaphore(frame_ready);
+    if (slice_done) SDL_DestroySemaphore(slice_done);
+    frame_ready = slice_done = NULL;
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+    render_enabled = false;
+}
+
+// The render thread is idle: give it the record the core just finished, take the other one
+static void hand_over(FrameRecord *rec) {
+    drawing = rec;
+    recording = (rec == &records[0]) ? &records[1] : &records[0];
+    SDL_AtomicSet(&busy, 1);
+    SDL_SemPost(frame_ready);
+}
+
+/* Opens a record on the first line of a frame drawn, that's line 1 right after
+   the lcd is switched on. Lines that never get drawn stay white. */
+void render_begin_frame(CPU *cpu) {
+    FrameRecord *rec = recording;
+    if (rec->open)
+        return;
+    memcpy(rec->vram, &cpu->memory[0x8000], sizeof(rec->vram));
+    memset(rec->shades, 0, sizeof(rec->shades));
+    memset(rec->fifo, true, sizeof(rec->fifo));
+    rec->log_len = 0;
+    rec->overflow = false;
+    rec->lines = 0;
+    rec->blank = false;
+    rec->colours = GAMEBOY_COLOURS;
+    rec->indexed = render_ppu->indexed;
+    rec->open = true;
+}
+
+void render_log_vram(uint16_t addr, uint8_t value) {
+    FrameRecord *rec = recording;
+    // VBlank writes are in the next frame's copy of VRAM anyway
+    if (!rec->open)
+        return;
+    if (rec->log_len == VRAM_LOG_SIZE) {
+        rec->overflow = true;
+        return;
+    }
+    rec->log[rec->log_len++] = (VramWrite){ addr - 0x8000, value, rec->lines };
+}
+
+// len bytes written in one go (HDMA), all or nothing goes into the log
+void render_log_vram_block(uint16_t addr, const uint8_t *values, int len) {
+    FrameRecord *rec = recording;
+    if (!rec->open)
+        return;
+    if (rec->log_len + len > VRAM_LOG_SIZE) {
+        rec->overflow = true;
+        return;
+    }
+    for (int i = 0; i < len; i++)
+        rec->log[rec->log_len++] = (VramWrite){ addr - 0x8000 + i, values[i], rec->lines };
+}
+
+uint8_t *render_fifo_line(uint8_t ly) {
+    return &recording->shades[ly * SCREEN_WIDTH];
+}
+
+// line is NULL for a line the FIFO already drew
+void render_record_line(uint8_t ly, const LineState *line) {
+    FrameRecord *rec = recording;
+    if (!rec->open)
+        return;
+    rec->fifo[ly] = (line == NULL);
+    if (line)
+        rec->line[ly] = *line;
+    rec->lines = ly + 1;
+}
+
+// LY 144: false if the frame couldn't be drawn, it counts as skipped
+bool render_end_frame(void) {
+    FrameRecord *rec = recording;
+    bool complete = rec->open && !rec->overflow;
+    rec->open = false;
+    if (!complete || SDL_AtomicGet(&busy))
+        return false;
+    shown_blank = false;
+    rec->period = render_ppu->periods;
+    hand_over(rec);
+    return true;
+}
+
+// Unlike a frame this can't be dropped, the screen has to go white
+void render_blank_frame(void) {
+    // LCDC gets written with the lcd off all the time, one white frame is enough
+    if (shown_blank)
+        return;
+    while (SDL_AtomicGet(&busy))
+        SDL_Delay(1);
+
+    FrameRecord *rec = recording;
+    rec->open = false;
+    rec->blank = true;
+    rec->colours = GAMEBOY_COLOURS;
+    rec->indexed = render_ppu->indexed;
+    rec->period = render_ppu->periods;
+    shown_blank = true;
+    hand_over(rec);
+}
@@ -0,0 +1,70 @@
+#include "cpu.h"
+#include "emu.h"
+#include "link.h"
+
+/* Serial port
+    SB (0xFF01) is the shift register, SC (0xFF02) bit 7 starts a transfer
+    and bit 0 picks the clock. With the internal clock a byte takes 8 bits
+    at 8192 Hz, after that SB holds the received byte, bit 7 of SC clears
+    and the serial interrupt is requested.
+    With the external clock nothing happens until the other side clocks,
+    which only ever happens over a link (see link.c).
+*/
+
+#define SERIAL_CYCLES_PER_BIT 512
+
+void serial_complete(CPU *cpu, uint8_t received) {
+    cpu->memory[0xFF01] = received;
+    cpu->memory[0xFF02] &= 0x7F;
+    cpu->serial_cycles = 0;
+    cpu->iflag |= 0x08; // Serial interrupt
+}
+
+void serial_control_write(CPU *cpu, uint8_t value) {
+    cpu->memory[0xFF02] = value;
+
+    if (!(value & 0x80)) {
+        cpu->serial_cycles = 0;
+        return;
+    }
+
+    if (value & 0x01) {
+        // still feeds serial_log, blargg's tests print through here
+        serial_write(cpu->memory[0xFF01]);
+
+        cpu->serial_cycles = 8 * SERIAL_CYCLES_PER_BIT;
+        cpu->serial_reply = false;
+        if (cpu->link) {
+            cpu->link->seq++;
+            link_send(cpu->link, LINK_DATA, cpu->link->seq, cpu->memory[0xFF01]);
+        }
+    }
+}
+
+// The other side's SB, or 0xFF (nothing plugged in) if it doesn't answer in time
+static uint8_t serial_wait_reply(CPU *cpu) {
+    Link *link = cpu->link;
+
+    if (!cpu->serial_reply && atomic_load(&link->channel->attached) == 2) {
+        uint32_t start = SDL_GetTicks();
+        while (!cpu->serial_reply && SDL_GetTicks() - start < LINK_WAIT_MS) {
+            SDL_Delay(0);
+            link_poll(cpu);
+        }
+    }
+    return cpu->serial_reply ? cpu->serial_in : 0xFF;
+}
+
+void serial_step(CPU *cpu, int tcycles) {
+    if (cpu->link)
+        link_poll(cpu);
+
+    if (cpu->serial_cycles <= 0)
+        return;
+
+    cpu->serial_cycles -= tcycles;
+    if (cpu->serial_cycles > 0)
+        return;
+
+    serial_complete(cpu, cpu->link ? serial_wait_reply(cpu) : 0xFF);
+}
@@ -0,0 +1,150 @@
+#include "trace.h"
+#include "cpu.h"
+#include "emu.h"
+#include <stdio.h>
+#include <stdatomic.h>
+
+/* Single producer (core thread), single consumer (writer thread).
+   head and tail only ever grow, the slot is (index & mask).
+   They live on separate cache lines so the two threads don't fight over them. */
+typedef struct {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    _Alignas(64) TraceRecord records[TRACE_RING_SIZE];
+} TraceRing;
+
+bool trace_enabled = false;
+
+static TraceRing ring;
+static size_t cached_tail;      // producer's last look at tail
+static TraceRecord *current;    // record of the instruction being executed
+
+static FILE *trace_file = NULL;
+static SDL_Thread *writer = NULL;
+static atomic_bool writer_stop;
+
+static int trace_writer(void *ptr) {
+    (void)ptr;
+    size_t tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+
+    while (1) {
+        size_t head = atomic_load_explicit(&ring.head, memory_order_acquire);
+
+        if (head == tail) {
+            if (atomic_load(&writer_stop)) break;
+            SDL_Delay(1);
+            continue;
+        }
+
+        // write the largest contiguous run, the wrap around gets the next pass
+        size_t start = tail & (TRACE_RING_SIZE - 1);
+        size_t count = head - tail;
+        if (count > TRACE_RING_SIZE - start)
+            count = TRACE_RING_SIZE - start;
+
+        fwrite(&ring.records[start], sizeof(TraceRecord), count, trace_file);
+        tail += count;
+        atomic_store_explicit(&ring.tail, tail, memory_order_release);
+    }
+    return 0;
+}
+
+bool trace_open(const char *path) {
+    trace_file = fopen(path, "wb");
+    if (!trace_file) {
+        printf("Error: Could not open trace file %s\n", path);
+        return false;
+    }
+
+    TraceHeader header = {0};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(TraceRecord);
+    fwrite(&header, sizeof(header), 1, trace_file);
+
+    atomic_init(&ring.head, 0);
+    atomic_init(&ring.tail, 0);
+    atomic_init(&writer_stop, false);
+    cached_tail = 0;
+    current = NULL;
+
+    writer = SDL_CreateThread(trace_writer, "admgeTrace", NULL);
+    if (!writer) {
+        printf("Error: Could not start the trace writer\n");
+        fclose(trace_file);
+        trace_file = NULL;
+        return false;
+    }
+
+    // -test mode leaves through exit(), the tail of the trace still has to land
+    atexit(trace_close);
+    trace_enabled = true;
+    printf("Tracing to %s\n", path);
+    return true;
+}
+
+void trace_close(void) {
+    if (!trace_file) return;
+
+    trace_enabled = false;
+    current = NULL;
+    atomic_store(&writer_stop, true);
+    SDL_WaitThread(writer, NULL);
+    writer = NULL;
+
+    fclose(trace_file);
+    trace_file = NULL;
+}
+
+/* Claims the next slot and fills in the state before the instruction runs.
+   Only blocks when the writer has fallen a whole ring behind. */
+void trace_begin(CPU *cpu, uint8_t opcode) {
+    size_t head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+
+    while (head - cached_tail >= TRACE_RING_SIZE) {
+        cached_tail = atomic_load_explicit(&ring.tail, memory_order_acquire);
+        if (head - cached_tail >= TRACE_RING_SIZE)
+            SDL_Delay(0);
+    }
+
+    TraceRecord *rec = &ring.records[head & (TRACE_RING_SIZE - 1)];
+    rec->cycle = cpu->total_cycles;
+    rec->pc = cpu->pc;
+    rec->sp = cpu->sp;
+    rec->af = cpu->regs.af;
+    rec->bc = cpu->regs.bc;
+    rec->de = cpu->regs.de;
+    rec->hl = cpu->regs.hl;
+    // these reads happen before current is set, so they don't show up as accesses
+    rec->pcmem[0] = opcode;
+    rec->pcmem[1] = read8(cpu, cpu->pc + 1);
+    rec->pcmem[2] = read8(cpu, cpu->pc + 2);
+    rec->pcmem[3] = read8(cpu, cpu->pc + 3);
+    rec->ime = cpu->ime;
+    rec->n_access = 0;
+    rec->rom_bank = cpu->curr_rom_bank;
+
+    current = rec;
+}
+
+// Called from the bus for every read8/write8 while tracing
+void trace_access(uint16_t addr, uint8_t value, uint8_t kind) {
+    if (!current) return;
+
+    if (current->n_access < TRACE_MAX_ACCESS) {
+        TraceAccess *acc = &current->access[current->n_access];
+        acc->addr = addr;
+        acc->value = value;
+        acc->kind = kind;
+    }
+    if (current->n_access < 0xFF)
+        current->n_access++;
+}
+
+// Publishes the record, the writer can pick it up from here on
+void trace_commit(void) {
+    if (!current) return;
+    current = NULL;
+    size_t head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+    atomic_store_explicit(&ring.head, head + 1, memory_order_release);
+}
@@ -2,139 +2,176 @@
 #include "cpu.h"
 #include "ui.h"
 #include "platform.h"
+#include "trace.h"
+#include "link.h"
+#include "aot.h"
+#include "render.h"
+#include "capture.h"
+#include "audio_ring.h"
+#include "pixel.h"
 
 #define BOOT_ROM "./bootrom/boot.bin"
 
 const uint64_t TIMEOUT_CYCLES = 20000000;
 const int CYCLES_PER_FRAME = 70224;
+// -drc: how far the sample rate may move from SAMPLE_RATE to keep the ring half full
+const double DRC_MAX_SKEW = 0.005;
 
-SDL_atomic_t quit_flag = {0};
-SDL_atomic_t muted = {0};
-SDL_atomic_t rom_loaded = {0};
-
-float win_scale = 0.7;
 bool ime_enable = false;
-bool bootrom_flag = true;
-char* inputRom;
-char serial_log[65536];  
-size_t serial_len = 0;
-uint8_t *rom = NULL;
-size_t rom_size = 0;
-bool enable_logging;
-FILE *log_file;
-
-// Palettes
-const uint32_t* GAMEBOY_COLOURS = NULL;
-const uint32_t MGB_COLOURS[4] = {
-    0xFFFFFFFF, // White
-    0xFFAAAAAA, // Light Gray
-    0xFF555555, // Dark Gray
-    0xFF000000  // Black
-};
-const uint32_t DMG_COLOURS[4] = {
-    0xFF9BBC0F, // Lightest Green
-    0xFF8BAC0F, // Light GreenT
-    0xFF306230, // Dark Green
-    0xFF0F380F  // Darkest Green
-};
-
-emu_mode current_mode = DMG;
+
+/* A frame's worth of cycles has run: pacing and the audio ring are only
+   looked at here, not after every instruction.
+   Without -drc the ring paces the core, it waits until the next audio
+   frame (up to AUDIO_RING_BATCH) fits in. With -drc the frame deadlines
+   do, and the audio side follows: the performance counter and the audio
+   device's clock never quite agree, so the sample rate goes up a little
+   while the ring is under half full and down while it's over, at most
+   DRC_MAX_SKEW either way.
+   The pitch change is far too small to hear, the ring never runs dry or
+   fills up, and the latency stays at half of it. */
+static void end_of_frame(CPU *cpu, uint64_t *deadline, uint64_t frame_ticks, uint64_t freq) {
+    uint64_t now = SDL_GetPerformanceCounter();
+    if (*deadline == 0)
+        *deadline = now; // the first frame
+    *deadline += frame_ticks;
+    // half a frame of slack, without -drc now wobbles by a callback period around it
+    cpu->ppu.running_late = now > *deadline + frame_ticks / 2;
+    // too far behind to catch up, don't keep skipping to pay it off
+    if (now > *deadline + 2 * frame_ticks)
+        *deadline = now;
+
+    const int half = AUDIO_RING_FRAMES / 2;
+    int fill = (int)audio_ring_fill(&audio_ring);
+    if (drc_flag) {
+        cpu->apu.rate_adjust = 1.0 + DRC_MAX_SKEW * (double)(half - fill) / half;
+        if (now < *deadline)
+            SDL_Delay((Uint32)((*deadline - now) * 1000 / freq));
+    }
+
+    // with -drc only if the audio device stalls
+    bool waited = false;
+    while (SDL_AtomicGet(&quit_flag) == 0 && fill > AUDIO_RING_FRAMES - AUDIO_RING_BATCH) {
+        SDL_Delay(1);
+        fill = (int)audio_ring_fill(&audio_ring);
+        waited = true;
+    }
+    // without -drc the ring is the clock: a frame that had to wait for it was on time,
+    // the deadlines start over from here rather than drift away from the audio clock
+    if (waited && !drc_flag)
+        *deadline = SDL_GetPerformanceCounter();
+}
 
 
 int core_thread(void *ptr){
 
     CPU *cpu = (CPU *) ptr;
     uint64_t freq = SDL_GetPerformanceFrequency();
-    uint64_t last_time = SDL_GetPerformanceCounter();
-    double cycle_ctr = 0;
     uint64_t test_cycles = 0;
+    // frame deadlines, end_of_frame starts them on the first frame
+    uint64_t frame_ticks = freq * CYCLES_PER_FRAME / GB_CLOCK_SPEED;
+    uint64_t deadline = 0;
+    uint64_t frame_end = 0; // total_cycles starts at 0 with the rom
 
     while(SDL_AtomicGet(&quit_flag) == 0){
         
         if(SDL_AtomicGet(&rom_loaded) == 0){
             SDL_Delay(10);
-            last_time = SDL_GetPerformanceCounter();
             continue;
         }
 
-        uint64_t curr_time = SDL_GetPerformanceCounter();
-        uint64_t ticks = curr_time - last_time;
-        last_time = curr_time;
-        cycle_ctr += ((double)ticks / (double)freq) * GB_CLOCK_SPEED;
-
-        if(cycle_ctr > 70224 * 2)
-            cycle_ctr = 70224 * 2;
-
-        while(SDL_AtomicGet(&quit_flag) == 0 && cycle_ctr > 0){
-            if(current_mode == TEST){
-                // headless test mode
-                uint8_t opcode = read8(cpu, cpu->pc);
-                // mooneye breakpoint
-                if (opcode == 0x40) {
-                    uint8_t b = (cpu->regs.bc >> 8) & 0xFF;
-                    uint8_t c = cpu->regs.bc & 0xFF;
-                    uint8_t d = (cpu->regs.de >> 8) & 0xFF;
-                    uint8_t e = cpu->regs.de & 0xFF;
-                    uint8_t h = (cpu->regs.hl >> 8) & 0xFF;
-                    uint8_t l = cpu->regs.hl & 0xFF;
-
-                    bool success = (b == 0x03 && c == 0x05 && d == 0x08 && 
-                                    e == 0x0D && h == 0x15 && l == 0x22);
-
-                    printf("\n--- Test Result ---\n");
-                    if (success) {
-                        printf("RESULT: PASSED\n");
-                        exit(0); 
-                    } else {
-                        printf("RESULT: FAILED\n");
-                        printf("Expected: 03 05 08 0D 15 22\n");
-                        printf("Actual:   %02X %02X %02X %02X %02X %02X\n", b, c, d, e, h, l);
-                        
-                        // Print serial output
-                        if (serial_len > 0) {
-                            printf("Serial Output: %s\n", serial_log);
-                        }
-                        exit(1);
+        if(current_mode == TEST){
+            // headless test mode, runs as fast as it can
+            uint8_t opcode = read8(cpu, cpu->pc);
+            // mooneye breakpoint
+            if (opcode == 0x40) {
+                uint8_t b = (cpu->regs.bc >> 8) & 0xFF;
+                uint8_t c = cpu->regs.bc & 0xFF;
+                uint8_t d = (cpu->regs.de >> 8) & 0xFF;
+                uint8_t e = cpu->regs.de & 0xFF;
+                uint8_t h = (cpu->regs.hl >> 8) & 0xFF;
+                uint8_t l = cpu->regs.hl & 0xFF;
+
+                bool success = (b == 0x03 && c == 0x05 && d == 0x08 && 
+                                e == 0x0D && h == 0x15 && l == 0x22);
+
+                printf("\n--- Test Result ---\n");
+                // what a test_runner <rom>.hash file would have to hold
+                printf("Frame hash: %016llx\n", (unsigned long long)frame_hash(ppu_acquire_frame(&cpu->ppu)));
+                if (success) {
+                    printf("RESULT: PASSED\n");
+                    exit(0); 
+                } else {
+                    printf("RESULT: FAILED\n");
+                    printf("Expected: 03 05 08 0D 15 22\n");
+                    printf("Actual:   %02X %02X %02X %02X %02X %02X\n", b, c, d, e, h, l);
+                    
+                    // Print serial output
+                    if (serial_len > 0) {
+                        printf("Serial Output: %s\n", serial_log);
                     }
-                }
-                cpu_step(cpu);
-                
-                test_cycles++;
-                if (test_cycles > TIMEOUT_CYCLES) {
-                    printf("RESULT: TIMEOUT\n");
                     exit(1);
                 }
             }
-            else{ // ALL MODES THAT ARE NOT TEST
-                cpu_step(cpu);
-                //log_cpu_state(&cpu, full_dump);
-                int read_pos = atomic_load(&cpu->apu.read_pos);
-                int write_pos = atomic_load(&cpu->apu.write_pos);
-                int buffer_fullness = (write_pos - read_pos + AUDIO_BUFFER_SIZE) % AUDIO_BUFFER_SIZE;
-
-                while (SDL_AtomicGet(&quit_flag) == 0 && buffer_fullness > (AUDIO_BUFFER_SIZE * 3 / 4)) {
-                    SDL_Delay(1); 
-                    read_pos = atomic_load(&cpu->apu.read_pos);
-                    buffer_fullness = (write_pos - read_pos + AUDIO_BUFFER_SIZE) % AUDIO_BUFFER_SIZE;
-                }
+            cpu_step(cpu);
+            
+            test_cycles++;
+            if (test_cycles > TIMEOUT_CYCLES) {
+                printf("RESULT: TIMEOUT\n");
+                exit(1);
             }
-            cycle_ctr -= cpu->cycles;
+            continue;
+        }
+
+        // ALL MODES THAT ARE NOT TEST: a frame's worth of cycles, then end_of_frame paces
+        frame_end += CYCLES_PER_FRAME;
+        while(SDL_AtomicGet(&quit_flag) == 0 && cpu->total_cycles < frame_end){
+            cpu_step(cpu);
+            //log_cpu_state(&cpu, full_dump);
         }
+        end_of_frame(cpu, &deadline, frame_ticks, freq);
     }
     return 0;
 
 }
 
 int main(int argc, char *argv[]) {
-        
+    const char *trace_path = NULL;
+    const char *link_name = NULL;
+    const char *aot_path = NULL;
+    const char *capture_path = NULL;
+    int capture_interval = 1;
+    bool indexed = false;
+    bool fifo = false;
+    bool layers = false;
+    bool highpass = false;
+    int render_threads = 0;
+    int frameskip = 0;
+
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-noboot") == 0) bootrom_flag = false;
         // else if (strcmp(argv[i], "-debug") == 0) current_mode = DEBUG;   
         else if (strcmp(argv[i], "-test")  == 0) current_mode = TEST;
         else if (strcmp(argv[i], "-mgb")   == 0) current_mode = MGB;
+        else if (strcmp(argv[i], "-dmg")   == 0) cgb_flag = false;
+        else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc) trace_path = argv[++i];
+        else if (strcmp(argv[i], "-link")  == 0 && i + 1 < argc) link_name = argv[++i];
+        else if (strcmp(argv[i], "-aot")   == 0 && i + 1 < argc) aot_path = argv[++i];
+        else if (strcmp(argv[i], "-capture") == 0 && i + 1 < argc) capture_path = argv[++i];
+        else if (strcmp(argv[i], "-capture-interval") == 0 && i + 1 < argc) capture_interval = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-indexed") == 0) indexed = true;
+        else if (strcmp(argv[i], "-fifo")  == 0) fifo = true;
+        else if (strcmp(argv[i], "-layers") == 0) layers = true;
+        else if (strcmp(argv[i], "-highpass") == 0) highpass = true;
+        else if (strcmp(argv[i], "-drc")   == 0) drc_flag = true;
+        else if (strcmp(argv[i], "-renderthreads") == 0 && i + 1 < argc) render_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-frameskip") == 0 && i + 1 < argc) {
+            i++;
+            frameskip = (strcmp(argv[i], "auto") == 0) ? FRAMESKIP_AUTO : atoi(argv[i]);
+        }
     }
 
-    CPU cpu;
+    // static, the three frames of the ppu are too much for the stack
+    static CPU cpu;
     GAMEBOY_COLOURS = (current_mode == MGB)? MGB_COLOURS : DMG_COLOURS;
 
     enable_logging = false;
@@ -170,6 +207,12 @@ int main(int argc, char *argv[]) {
     else
         start_cpu_noboot(&cpu); // This one does not need a bootrom
 
+    cpu.ppu.indexed = indexed;
+    cpu.ppu.fifo_always = fifo;
+    cpu.ppu.use_layers = layers;
+    cpu.ppu.frameskip = frameskip;
+    cpu.apu.highpass = highpass;
+
     // If path is available, rom gets loaded here.
     // more than one arg, and the second arg does not start with '-'
     if (argc >= 2 && argv[1][0] != '-'){
@@ -184,8 +227,20 @@ int main(int argc, char *argv[]) {
     if (current_mode != TEST){
         init_screen();
         init_audio(&cpu);
+        printf("Pixel kernels: %s\n", pixel_kernel_name());
     }
 
+    if (trace_path)
+        trace_open(trace_path);
+    if (link_name)
+        link_open_shared(&cpu, link_name);
+    if (aot_path)
+        aot_load(aot_path);
+    if (render_threads > 0)
+        render_start(&cpu.ppu, render_threads);
+    if (capture_path)
+        capture_open(capture_path, capture_interval);
+
     //FILE *full_dump = fopen("full_dump.txt", "w");
     //Starting the Emulator thread
     SDL_Thread *emu_thread = SDL_CreateThread(core_thread, "admgeCore", &cpu);
@@ -198,6 +253,18 @@ int main(int argc, char *argv[]) {
         SDL_Delay(1);
     }
     SDL_WaitThread(emu_thread, NULL);
+    render_stop();
+    capture_close();
+    if (frameskip != 0)
+        printf("Skipped %u frames, drew %u\n", cpu.ppu.frames_skipped, cpu.ppu.frame_seq);
+    if (current_mode != TEST)
+        printf("Drew %llu lines, reused %llu unchanged ones\n",
+               (unsigned long long)cpu.ppu.lines_drawn, (unsigned long long)cpu.ppu.lines_reused);
+    if (cpu.apu.frames_dropped)
+        printf("Dropped %llu audio frames the ring had no room for\n", (unsigned long long)cpu.apu.frames_dropped);
+    trace_close();
+    link_close(&cpu);
+    aot_unload();
 
     //fclose(full_dump);
     if (log_file) {
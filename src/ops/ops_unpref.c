@@ -154,6 +154,11 @@ void run_inst(uint8_t opcode, CPU *cpu){
             cpu->stopped = true;
             cpu->pc += 2;
             // STOP switches CPU to double-speed mode on CGB, does nothing on DMG
+            if (cpu->ppu.cgb && (cpu->key1 & 0x01)) {
+                cpu->double_speed = !cpu->double_speed;
+                cpu->key1 = 0;
+                cpu->div = 0;
+            }
             cpu->cycles += 1;
             break;
 
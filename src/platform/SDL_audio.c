@@ -1,35 +1,24 @@
 #include "cpu.h"
 #include "platform.h"
+#include "audio_ring.h"
 
 static SDL_AudioDeviceID audio_device;
 
 /**
  * This is the "Consumer" thread.
  * It runs completely separate from the main emulator loop.
- * It's job is to pull samples from the ring buffer and give them to SDL.
+ * It's job is to pull samples from the ring buffer and give them to SDL,
+ * all it has in one copy, silence for whatever the core hasn't made yet.
  */
 static void audio_callback(void *userdata, Uint8 *stream, int len) {
-    CPU *cpu = (CPU *)userdata;
-    APU *apu = &cpu->apu;
-    
-    // Cast the stream buffer to 16-bit signed samples
-    int16_t *output_buffer = (int16_t *)stream;
-    
-    int samples_needed = len / sizeof(int16_t);
+    (void)userdata;
 
-    for (int i = 0; i < samples_needed; i++) {
-        int read_pos = atomic_load(&apu->read_pos);
-        int write_pos = atomic_load(&apu->write_pos);
+    // Cast the stream buffer to 16-bit signed samples, two per frame
+    int16_t *output_buffer = (int16_t *)stream;
+    size_t frames_needed = len / (2 * sizeof(int16_t));
 
-        if (read_pos == write_pos) {
-            output_buffer[i] = 0;
-        } else {
-            output_buffer[i] = apu->internal_buffer[read_pos];
-            
-            read_pos = (read_pos + 1) % AUDIO_BUFFER_SIZE;
-            atomic_store(&apu->read_pos, read_pos);
-        }
-    }
+    size_t got = audio_ring_read(&audio_ring, output_buffer, frames_needed);
+    memset(&output_buffer[got * 2], 0, (frames_needed - got) * 2 * sizeof(int16_t));
 }
 
 void init_audio(CPU *cpu) {
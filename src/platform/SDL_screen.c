@@ -1,6 +1,7 @@
 #include "platform.h"
 #include "ui.h"
 #include "emu.h"
+#include "pixel.h"
 
 SDL_Window *window = NULL;
 SDL_Renderer *renderer = NULL;
@@ -62,10 +63,83 @@ bool init_screen() {
     return true;
 }
 
+// ImGui needs a few frames to catch up with an input (hover, pressed buttons)
+#define UI_REDRAW_FRAMES 3
+static int ui_redraws = UI_REDRAW_FRAMES;
+
+// Something other than the game changed what the window shows, draw it again
+void screen_invalidate(void) {
+    ui_redraws = UI_REDRAW_FRAMES;
+}
+
+// Uploads rows [first, last) of a frame into the texture, colours is NULL unless it's indexed
+static void upload_rows(const Frame *frame, const uint32_t *colours, int first, int last) {
+    SDL_Rect rect = { 0, first, SCREEN_WIDTH, last - first };
+    if (colours) {
+        // colours get picked here, so a palette switch shows up right away
+        void *pixels;
+        int pitch;
+        if (SDL_LockTexture(texture, &rect, &pixels, &pitch) == 0) {
+            for (int y = first; y < last; y++)
+                pixel_to_argb(&frame->shades[y * SCREEN_WIDTH], (uint32_t *)((uint8_t *)pixels + (y - first) * pitch),
+                              colours, SCREEN_WIDTH);
+            SDL_UnlockTexture(texture);
+        }
+    }
+    else
+        SDL_UpdateTexture(texture, &rect, &frame->pixels[first * SCREEN_WIDTH], SCREEN_WIDTH * sizeof(uint32_t));
+}
+
+/* Called about every millisecond, but only does work when there is something new:
+   a frame with rows that differ from what's in the texture, or a UI change. Only the
+   changed rows get uploaded, in runs, and the window is only presented again then. */
 void present_screen(PPU *ppu, CPU *cpu) {
     if (current_mode == TEST) return;
     ////printf("Presenting...\n");
-    SDL_UpdateTexture(texture, NULL, ppu->framebuffer, SCREEN_WIDTH * sizeof(uint32_t));
+    static uint32_t shown_seq = UINT32_MAX;
+    static const uint32_t *shown_colours = NULL;
+    // what the texture holds right now
+    static uint8_t shown_shades[SCREEN_WIDTH * SCREEN_HEIGHT];
+    static uint32_t shown_pixels[SCREEN_WIDTH * SCREEN_HEIGHT];
+
+    bool uploaded = false;
+    const Frame *frame = ppu_acquire_frame(ppu);
+    const uint32_t *colours = GAMEBOY_COLOURS;
+    bool recolour = ppu->indexed && colours != shown_colours;
+    if (frame->seq != shown_seq || recolour) {
+        // the first frame goes up whole
+        bool all = recolour || shown_seq == UINT32_MAX;
+        shown_seq = frame->seq;
+        shown_colours = colours;
+
+        int run = -1; // first row of the current run of changed rows
+        for (int y = 0; y <= SCREEN_HEIGHT; y++) {
+            bool changed = false;
+            if (y < SCREEN_HEIGHT) {
+                uint32_t offset = y * SCREEN_WIDTH;
+                if (ppu->indexed)
+                    changed = all || memcmp(&frame->shades[offset], &shown_shades[offset], SCREEN_WIDTH) != 0;
+                else
+                    changed = all || memcmp(&frame->pixels[offset], &shown_pixels[offset], SCREEN_WIDTH * sizeof(uint32_t)) != 0;
+            }
+            if (changed && run < 0)
+                run = y;
+            else if (!changed && run >= 0) {
+                upload_rows(frame, ppu->indexed ? colours : NULL, run, y);
+                uint32_t offset = run * SCREEN_WIDTH, count = (y - run) * SCREEN_WIDTH;
+                memcpy(&shown_shades[offset], &frame->shades[offset], count);
+                memcpy(&shown_pixels[offset], &frame->pixels[offset], count * sizeof(uint32_t));
+                uploaded = true;
+                run = -1;
+            }
+        }
+    }
+
+    if (!uploaded && ui_redraws == 0)
+        return;
+    if (ui_redraws > 0)
+        ui_redraws--;
+
     SDL_RenderClear(renderer);
     // SDL_RenderCopy(renderer, texture, NULL, NULL);
     ui_render(texture, outer_shell, renderer, cpu);
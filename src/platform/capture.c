@@ -0,0 +1,261 @@
+#define _POSIX_C_SOURCE 200809L
+#include "capture.h"
+#include "platform.h"
+#include "pixel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+/* Single producer (whoever publishes frames: the core or the render thread),
+   single consumer (writer thread), the same kind of ring as the trace.
+   A slot is the frame's pixels, the writer turns them into whatever the
+   format wants. Output goes by frame period rather than by published frame:
+   a period that has no frame (skipped, dropped, lcd off) repeats the last one. */
+
+#define FRAME_SIZE (SCREEN_WIDTH * SCREEN_HEIGHT)
+
+enum { CAPTURE_Y4M, CAPTURE_RAW, CAPTURE_PNG };
+
+typedef struct {
+    uint32_t pixels[FRAME_SIZE];
+    uint32_t number; // the frame period it was finished in
+} CaptureSlot;
+
+typedef struct {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    _Alignas(64) CaptureSlot slots[CAPTURE_QUEUE_SIZE];
+} CaptureQueue;
+
+bool capture_enabled = false;
+
+static CaptureQueue queue;
+static uint32_t interval;
+static uint32_t dropped;      // producer side
+static uint32_t written;      // writer side
+static uint32_t repeated;
+static uint32_t next_number;  // the next period to write, a multiple of interval
+static CaptureSlot last;      // the newest frame the writer has seen
+static bool have_last;
+
+static int format;
+static FILE *out = NULL;
+static bool piped;
+static char png_stem[1024];   // path without the .png
+static SDL_Thread *writer = NULL;
+static atomic_bool writer_stop;
+static bool write_failed;
+
+static bool has_extension(const char *path, const char *ext) {
+    size_t len = strlen(path), ext_len = strlen(ext);
+    return len >= ext_len && strcmp(path + len - ext_len, ext) == 0;
+}
+
+// BT.601, studio range
+static void to_yuv(uint32_t argb, uint8_t yuv[3]) {
+    int r = (argb >> 16) & 0xFF, g = (argb >> 8) & 0xFF, b = argb & 0xFF;
+    yuv[0] = (( 66 * r + 129 * g +  25 * b + 128) >> 8) + 16;
+    yuv[1] = ((-38 * r -  74 * g + 112 * b + 128) >> 8) + 128;
+    yuv[2] = ((112 * r -  94 * g -  18 * b + 128) >> 8) + 128;
+}
+
+static bool write_y4m(const uint32_t *pixels) {
+    static uint8_t planes[3][FRAME_SIZE];
+    // a DMG frame has 4 colours, a CGB one rarely many more: convert each run once
+    uint32_t last = ~pixels[0];
+    uint8_t yuv[3] = { 0, 0, 0 };
+    for (int i = 0; i < FRAME_SIZE; i++) {
+        if (pixels[i] != last) {
+            last = pixels[i];
+            to_yuv(last, yuv);
+        }
+        planes[0][i] = yuv[0];
+        planes[1][i] = yuv[1];
+        planes[2][i] = yuv[2];
+    }
+
+    return fputs("FRAME\n", out) >= 0 && fwrite(planes, sizeof(planes), 1, out) == 1;
+}
+
+static bool write_raw(const uint32_t *pixels) {
+    static uint8_t rgb[FRAME_SIZE * 3];
+    for (int i = 0; i < FRAME_SIZE; i++) {
+        uint32_t c = pixels[i];
+        rgb[i * 3 + 0] = (c >> 16) & 0xFF;
+        rgb[i * 3 + 1] = (c >> 8) & 0xFF;
+        rgb[i * 3 + 2] = c & 0xFF;
+    }
+    return fwrite(rgb, sizeof(rgb), 1, out) == 1;
+}
+
+static bool write_png(const uint32_t *pixels, uint32_t number) {
+    // the writer owns the slot until it moves tail on
+    SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormatFrom((void *)pixels, SCREEN_WIDTH, SCREEN_HEIGHT, 32,
+                                                              SCREEN_WIDTH * 4, SDL_PIXELFORMAT_ARGB8888);
+    if (!surface)
+        return false;
+    char name[1100];
+    snprintf(name, sizeof(name), "%s_%06u.png", png_stem, number);
+    bool ok = IMG_SavePNG(surface, name) == 0;
+    SDL_FreeSurface(surface);
+    return ok;
+}
+
+static void write_frame(const uint32_t *pixels, uint32_t number) {
+    if (write_failed)
+        return;
+    bool ok = (format == CAPTURE_Y4M) ? write_y4m(pixels)
+            : (format == CAPTURE_RAW) ? write_raw(pixels)
+            : write_png(pixels, number);
+    if (ok)
+        written++;
+    else {
+        // keep draining so the core isn't left dropping everything, just stop writing
+        printf("Error: Could not write captured frame %u\n", number);
+        write_failed = true;
+    }
+}
+
+/* Every interval'th period gets written: the frame from that period, or the
+   newest one before it. Before the first frame there's nothing older, that
+   one stands in for the periods it missed. */
+static void take_frame(const CaptureSlot *slot) {
+    const CaptureSlot *fill = have_last ? &last : slot;
+    while (next_number < slot->number) {
+        write_frame(fill->pixels, next_number);
+        repeated++;
+        next_number += interval;
+    }
+    if (next_number == slot->number) {
+        write_frame(slot->pixels, next_number);
+        next_number += interval;
+    }
+    last = *slot;
+    have_last = true;
+}
+
+static int capture_writer(void *ptr) {
+    (void)ptr;
+    size_t tail = atomic_load_explicit(&queue.tail, memory_order_relaxed);
+
+    while (1) {
+        size_t head = atomic_load_explicit(&queue.head, memory_order_acquire);
+
+        if (head == tail) {
+            if (atomic_load(&writer_stop)) break;
+            SDL_Delay(1);
+            continue;
+        }
+
+        take_frame(&queue.slots[tail & (CAPTURE_QUEUE_SIZE - 1)]);
+        tail++;
+        atomic_store_explicit(&queue.tail, tail, memory_order_release);
+    }
+    return 0;
+}
+
+bool capture_open(const char *path, int every) {
+    piped = (path[0] == '|');
+    if (piped || has_extension(path, ".y4m"))
+        format = CAPTURE_Y4M;
+    else if (has_extension(path, ".png"))
+        format = CAPTURE_PNG;
+    else
+        format = CAPTURE_RAW;
+    interval = (every > 1) ? every : 1;
+
+    if (format == CAPTURE_PNG) {
+        size_t len = strlen(path) - 4;
+        if (len >= sizeof(png_stem)) {
+            printf("Error: Capture path too long\n");
+            return false;
+        }
+        memcpy(png_stem, path, len);
+        png_stem[len] = '\0';
+    }
+    else {
+        if (piped) {
+            // the reader going away shouldn't take the emulator with it
+            signal(SIGPIPE, SIG_IGN);
+            out = popen(path + 1, "w");
+        }
+        else
+            out = fopen(path, "wb");
+        if (!out) {
+            printf("Error: Could not open capture output %s\n", path);
+            return false;
+        }
+        // ~59.73 fps, a frame per period, interval periods long
+        if (format == CAPTURE_Y4M)
+            fprintf(out, "YUV4MPEG2 W%d H%d F4194304:%u Ip A1:1 C444\n",
+                    SCREEN_WIDTH, SCREEN_HEIGHT, 70224 * interval);
+    }
+
+    atomic_init(&queue.head, 0);
+    atomic_init(&queue.tail, 0);
+    atomic_init(&writer_stop, false);
+    dropped = 0;
+    written = 0;
+    repeated = 0;
+    next_number = 0;
+    have_last = false;
+    write_failed = false;
+
+    writer = SDL_CreateThread(capture_writer, "admgeCapture", NULL);
+    if (!writer) {
+        printf("Error: Could not start the capture writer\n");
+        if (out) {
+            if (piped) pclose(out); else fclose(out);
+            out = NULL;
+        }
+        return false;
+    }
+
+    // -test mode leaves through exit(), what's still queued has to land
+    atexit(capture_close);
+    capture_enabled = true;
+    printf("Capturing to %s\n", path);
+    return true;
+}
+
+void capture_close(void) {
+    if (!writer) return;
+
+    capture_enabled = false;
+    atomic_store(&writer_stop, true);
+    SDL_WaitThread(writer, NULL);
+    writer = NULL;
+
+    if (out) {
+        if (piped) pclose(out); else fclose(out);
+        out = NULL;
+    }
+    printf("Captured %u frames", written);
+    if (repeated)
+        printf(", %u of them repeats for periods without a frame", repeated);
+    if (dropped)
+        printf(", dropped %u the writer couldn't keep up with", dropped);
+    printf("\n");
+}
+
+/* Never waits: with the queue full the frame is simply not captured, its
+   period repeats the one before. Frames between the kept ones go in too,
+   one of them may have to stand in for a kept period that had none. */
+void capture_frame(const Frame *frame, const uint32_t colours[4]) {
+    size_t head = atomic_load_explicit(&queue.head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue.tail, memory_order_acquire);
+    if (head - tail >= CAPTURE_QUEUE_SIZE) {
+        dropped++;
+        return;
+    }
+
+    CaptureSlot *slot = &queue.slots[head & (CAPTURE_QUEUE_SIZE - 1)];
+    if (colours)
+        pixel_to_argb(frame->shades, slot->pixels, colours, FRAME_SIZE);
+    else
+        memcpy(slot->pixels, frame->pixels, sizeof(slot->pixels));
+    slot->number = frame->period;
+    atomic_store_explicit(&queue.head, head + 1, memory_order_release);
+}
@@ -1,6 +1,7 @@
 #include "emu.h"
 #include "cpu.h"
 #include "ui.h"
+#include "platform.h"
 
 void dump_serial_log(const char *filename) {
     FILE *f = fopen(filename, "w");
@@ -97,6 +98,8 @@ void handle_input(CPU* cpu) {
     uint8_t last_joypad = cpu->joypad;
     while (SDL_PollEvent(&event)) {
         ui_handle_event(&event);
+        // mouse, keys, window exposed or resized: the UI may look different
+        screen_invalidate();
         if (event.type == SDL_QUIT)
             SDL_AtomicSet(&quit_flag, 1);
 
@@ -139,6 +142,11 @@ void handle_input(CPU* cpu) {
                     case SDLK_m:
                         if(is_pressed) SDL_AtomicSet(&muted, !SDL_AtomicGet(&muted));
                         break;
+                    // switch between the dmg and mgb colours
+                    case SDLK_p:
+                        if(is_pressed)
+                            GAMEBOY_COLOURS = (GAMEBOY_COLOURS == DMG_COLOURS) ? MGB_COLOURS : DMG_COLOURS;
+                        break;
                     case SDLK_RETURN:
                         is_pressed ? (cpu->joypad &= ~BUTTON_ST) : (cpu->joypad |= BUTTON_ST);
                         break;
@@ -0,0 +1,400 @@
+/* Compiles the reachable code of a cartridge ahead of time into C.
+
+    ./bin/gb2c rom.gb -o rom_aot.c
+    cc -O2 -shared -fPIC -Iinclude rom_aot.c -o rom.so
+    ./bin/admge rom.gb -aot rom.so          (or just: make aot ROM=rom.gb)
+
+    Code is found by walking from the entry point, the rst vectors and the
+    interrupt vectors, following jumps and calls. Switchable banks are
+    followed while the bank is known: code inside bank n stays in bank n,
+    and `ld a,n / ld ($2000-$3FFF),a` tells us where bank 0 code goes next.
+    Jumps through registers, RAM code and banks chosen at runtime are left
+    to the interpreter.
+
+    Each basic block becomes a function that runs its instructions one
+    after the other. Loads between registers and immediate loads are
+    written out, the rest calls run_inst with the opcode already decoded.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "aot.h"
+
+#define MAX_BLOCK 64 // instructions
+
+// per (bank, address) flags
+#define F_CODE   0x01 // an instruction starts here
+#define F_LEADER 0x02 // a block starts here
+#define F_QUEUED 0x04
+
+enum { FLOW_NONE, FLOW_BRANCH, FLOW_JUMP, FLOW_CALL, FLOW_RET, FLOW_STOP, FLOW_INVALID };
+
+typedef struct {
+    uint16_t bank;
+    uint16_t addr;
+    int16_t known; // the bank in 0x4000-0x7FFF, -1 when we don't know it
+} Entry;
+
+static uint8_t *rom;
+static size_t rom_size;
+static uint32_t banks;
+static uint8_t mbc_type;
+static uint8_t *flags;
+
+static Entry *work;
+static size_t work_len, work_cap;
+
+static size_t key(uint32_t bank, uint16_t addr) {
+    return ((size_t)bank << 15) | addr;
+}
+
+static bool fetch(uint32_t bank, uint16_t addr, uint8_t *out) {
+    size_t offset = (size_t)bank * 0x4000 + (addr & 0x3FFF);
+    if (bank >= banks || offset >= rom_size)
+        return false;
+    *out = rom[offset];
+    return true;
+}
+
+static int op_length(uint8_t op) {
+    switch (op) {
+        case 0x01: case 0x08: case 0x11: case 0x21: case 0x31:
+        case 0xC2: case 0xC3: case 0xC4: case 0xCA: case 0xCC: case 0xCD:
+        case 0xD2: case 0xD4: case 0xDA: case 0xDC: case 0xEA: case 0xFA:
+            return 3;
+        case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x36: case 0x3E:
+        case 0x10: case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: case 0xCB:
+        case 0xC6: case 0xCE: case 0xD6: case 0xDE: case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+        case 0xE0: case 0xE8: case 0xF0: case 0xF8:
+            return 2;
+    }
+    return 1;
+}
+
+static int op_flow(uint8_t op) {
+    switch (op) {
+        case 0x20: case 0x28: case 0x30: case 0x38:
+        case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+            return FLOW_BRANCH;
+        case 0x18: case 0xC3: case 0xE9:
+            return FLOW_JUMP;
+        case 0xC4: case 0xCC: case 0xD4: case 0xDC: case 0xCD:
+        case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+            return FLOW_CALL;
+        case 0xC0: case 0xC8: case 0xD0: case 0xD8: case 0xC9: case 0xD9:
+            return FLOW_RET;
+        case 0x10: case 0x76:
+            return FLOW_STOP;
+        // holes, nothing real runs into these
+        case 0xD3: case 0xDB: case 0xDD: case 0xE3: case 0xE4: case 0xEB:
+        case 0xEC: case 0xED: case 0xF4: case 0xFC: case 0xFD:
+            return FLOW_INVALID;
+    }
+    return FLOW_NONE;
+}
+
+// Where a jump/call lands, -1 for jumps through HL and returns
+static int op_target(uint8_t op, uint16_t addr, const uint8_t *bytes) {
+    switch (op) {
+        case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+            return (uint16_t)(addr + 2 + (int8_t)bytes[1]);
+        case 0xC2: case 0xC3: case 0xC4: case 0xCA: case 0xCC: case 0xCD:
+        case 0xD2: case 0xD4: case 0xDA: case 0xDC:
+            return bytes[1] | (bytes[2] << 8);
+        case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+            return op & 0x38;
+    }
+    return -1;
+}
+
+// The bank a write of value to 0x2000-0x3FFF selects, -1 if we can't tell
+static int mbc_select(uint16_t addr, uint8_t value) {
+    if (mbc_type >= 0x01 && mbc_type <= 0x03) {
+        return (value & 0x1F) ? (value & 0x1F) : 1;
+    }
+    if (mbc_type >= 0x0F && mbc_type <= 0x13) {
+        return (value & 0x7F) ? (value & 0x7F) : 1;
+    }
+    if (mbc_type >= 0x19 && mbc_type <= 0x1E) {
+        return addr <= 0x2FFF ? value : -1; // 0x3000 is bit 8
+    }
+    return -1;
+}
+
+static void queue(uint32_t bank, int addr, int known) {
+    if (addr < 0 || addr > 0x7FFF)
+        return; // RAM, HRAM... not ours
+
+    if (addr >= 0x4000) {
+        // code in a switchable bank stays there unless told otherwise
+        if (known < 0) return;
+        bank = known;
+    }
+    else {
+        bank = 0;
+    }
+    if (bank >= banks)
+        return;
+
+    size_t k = key(bank, addr);
+    flags[k] |= F_LEADER;
+    if (flags[k] & F_QUEUED)
+        return;
+    flags[k] |= F_QUEUED;
+
+    if (work_len == work_cap) {
+        work_cap = work_cap ? work_cap * 2 : 1024;
+        work = realloc(work, work_cap * sizeof(Entry));
+        if (!work) {
+            printf("Error: Out of memory\n");
+            exit(1);
+        }
+    }
+    work[work_len++] = (Entry){ (uint16_t)bank, (uint16_t)addr, (int16_t)known };
+}
+
+// Follows straight line code from one entry, queueing every target on the way
+static void walk(Entry entry) {
+    uint32_t bank = entry.bank;
+    uint16_t addr = entry.addr;
+    int known = addr >= 0x4000 ? (int)bank : entry.known;
+    uint16_t end = addr >= 0x4000 ? 0x8000 : 0x4000;
+    int a_value = -1; // A after `ld a,n`
+
+    while (addr < end) {
+        uint8_t bytes[3] = {0};
+        if (!fetch(bank, addr, &bytes[0]))
+            return;
+
+        int len = op_length(bytes[0]);
+        int flow = op_flow(bytes[0]);
+        if (flow == FLOW_INVALID || addr + len > end)
+            return;
+        for (int i = 1; i < len; i++)
+            if (!fetch(bank, addr + i, &bytes[i]))
+                return;
+
+        size_t k = key(bank, addr);
+        if (flags[k] & F_CODE)
+            return; // joined code we already walked
+        flags[k] |= F_CODE;
+
+        // LD B,B is the debugger breakpoint, give it its own block so cpu_step sees it
+        if (bytes[0] == 0x40)
+            flags[k] |= F_LEADER;
+
+        // ld ($2000-$3FFF),a with a known A switches banks
+        if (bytes[0] == 0xEA) {
+            uint16_t dest = bytes[1] | (bytes[2] << 8);
+            if (dest >= 0x2000 && dest <= 0x3FFF) {
+                if (end == 0x8000)
+                    return; // switching away from under ourselves, leave that to the interpreter
+                known = a_value >= 0 ? mbc_select(dest, (uint8_t)a_value) : -1;
+            }
+        }
+        a_value = bytes[0] == 0x3E ? bytes[1] : -1;
+
+        int target = op_target(bytes[0], addr, bytes);
+        uint16_t next = addr + len;
+
+        switch (flow) {
+            case FLOW_BRANCH:
+            case FLOW_CALL:
+                queue(bank, target, known);
+                queue(bank, next, known);
+                return;
+            case FLOW_JUMP:
+                queue(bank, target, known);
+                return;
+            case FLOW_RET:
+                if (bytes[0] != 0xC9 && bytes[0] != 0xD9)
+                    queue(bank, next, known); // conditional returns fall through
+                return;
+            case FLOW_STOP:
+                queue(bank, next, known);
+                return;
+        }
+        addr = next;
+    }
+}
+
+static const char *reg8[8] = { "b", "c", "d", "e", "h", "l", NULL, "a" };
+
+/* Writes the instruction out. Only what the interpreter does in the
+   same way without touching the bus is inlined, cycles included. */
+static void emit_inst(FILE *out, uint16_t addr, const uint8_t *bytes, int len) {
+    uint8_t op = bytes[0];
+    uint16_t next = addr + len;
+    uint16_t imm16 = bytes[1] | (bytes[2] << 8);
+
+    fprintf(out, "    /* %04X:", addr);
+    for (int i = 0; i < len; i++)
+        fprintf(out, " %02X", bytes[i]);
+    fprintf(out, " */\n    ei = cpu->ime_enable;\n");
+
+    if (op == 0x00) {
+        fprintf(out, "    cpu->pc = 0x%04X;\n", next);
+    }
+    else if (op >= 0x40 && op <= 0x7F && op != 0x76 && reg8[(op >> 3) & 7] && reg8[op & 7]) {
+        fprintf(out, "    cpu->regs.%s = cpu->regs.%s; cpu->pc = 0x%04X; cpu->cycles += 1;\n",
+                reg8[(op >> 3) & 7], reg8[op & 7], next);
+    }
+    else if ((op & 0xC7) == 0x06 && reg8[(op >> 3) & 7]) {
+        fprintf(out, "    cpu->regs.%s = 0x%02X; cpu->pc = 0x%04X; cpu->cycles += 2;\n",
+                reg8[(op >> 3) & 7], bytes[1], next);
+    }
+    else if ((op & 0xCF) == 0x01) {
+        static const char *reg16[4] = { "regs.bc", "regs.de", "regs.hl", "sp" };
+        fprintf(out, "    cpu->%s = 0x%04X; cpu->pc = 0x%04X; cpu->cycles += 3;\n",
+                reg16[op >> 4], imm16, next);
+    }
+    else if (op == 0xC3) {
+        fprintf(out, "    cpu->pc = 0x%04X; cpu->cycles += 4;\n", imm16);
+    }
+    else if (op == 0x18) {
+        fprintf(out, "    cpu->pc = 0x%04X; cpu->cycles += 3;\n",
+                (uint16_t)(next + (int8_t)bytes[1]));
+    }
+    else {
+        fprintf(out, "    run_inst(0x%02X, cpu);\n", op);
+    }
+    fprintf(out, "    cpu_retire(cpu, ei);\n");
+}
+
+// One function per leader, returns the number of instructions in it
+static int emit_block(FILE *out, uint32_t bank, uint16_t start) {
+    uint16_t end = start >= 0x4000 ? 0x8000 : 0x4000;
+    uint16_t addr = start;
+    int count = 0;
+
+    fprintf(out, "static void b%03X_%04X(CPU *cpu) {\n", bank, start);
+    fprintf(out, "    const AotBanks banks = AOT_ENTER(cpu);\n    bool ei;\n");
+    for (;;) {
+        uint8_t bytes[3] = {0};
+        fetch(bank, addr, &bytes[0]);
+        int len = op_length(bytes[0]);
+        for (int i = 1; i < len; i++)
+            fetch(bank, addr + i, &bytes[i]);
+
+        emit_inst(out, addr, bytes, len);
+        count++;
+
+        uint16_t next = addr + len;
+        if (op_flow(bytes[0]) != FLOW_NONE || count == MAX_BLOCK || next >= end)
+            break;
+        size_t k = key(bank, next);
+        if (!(flags[k] & F_CODE) || (flags[k] & F_LEADER))
+            break;
+
+        fprintf(out, "    if (AOT_LEAVE(cpu, banks)) return;\n");
+        addr = next;
+    }
+    fprintf(out, "    (void)banks;\n}\n\n");
+    return count;
+}
+
+static bool load(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        printf("Error: Could not open %s\n", path);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size < 0x150) {
+        printf("Error: %s is too small to be a rom\n", path);
+        fclose(file);
+        return false;
+    }
+
+    rom_size = size;
+    rom = malloc(rom_size);
+    if (!rom || fread(rom, 1, rom_size, file) != rom_size) {
+        printf("Error: Could not read %s\n", path);
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+
+    banks = (rom_size + 0x3FFF) / 0x4000;
+    mbc_type = rom[0x0147];
+    flags = calloc((size_t)banks << 15, 1);
+    return flags != NULL;
+}
+
+int main(int argc, char *argv[]) {
+    const char *rom_path = NULL;
+    const char *out_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) out_path = argv[++i];
+        else rom_path = argv[i];
+    }
+    if (!rom_path || !out_path) {
+        printf("Usage: %s rom.gb -o rom_aot.c\n", argv[0]);
+        return 1;
+    }
+    if (!load(rom_path))
+        return 1;
+
+    // a cartridge without mbc has bank 1 mapped from the start
+    int start_bank = banks > 1 ? 1 : -1;
+
+    queue(0, 0x0100, start_bank);
+    for (int vector = 0x00; vector <= 0x60; vector += 8)
+        queue(0, vector, -1);
+
+    while (work_len > 0) {
+        Entry entry = work[--work_len];
+        walk(entry);
+    }
+
+    FILE *out = fopen(out_path, "w");
+    if (!out) {
+        printf("Error: Could not open %s for writing\n", out_path);
+        return 1;
+    }
+
+    fprintf(out, "/* Generated by gb2c from %s, do not edit */\n", rom_path);
+    fprintf(out, "#include \"cpu.h\"\n#include \"aot.h\"\n\n");
+    fprintf(out, "const unsigned %s = %d;\n", AOT_VERSION_SYMBOL, AOT_VERSION);
+    fprintf(out, "const unsigned %s = sizeof(CPU);\n", AOT_CPU_SIZE_SYMBOL);
+    uint8_t id[AOT_ROM_ID_SIZE];
+    aot_rom_id(rom, id);
+    fprintf(out, "const uint8_t %s[%d] = {", AOT_ROM_ID_SYMBOL, AOT_ROM_ID_SIZE);
+    for (int i = 0; i < AOT_ROM_ID_SIZE; i++)
+        fprintf(out, "%s0x%02X", i ? ", " : " ", id[i]);
+    fprintf(out, " };\n\n");
+
+    unsigned blocks = 0, insts = 0;
+    for (uint32_t bank = 0; bank < banks; bank++) {
+        for (uint32_t addr = bank ? 0x4000 : 0x0000; addr < (bank ? 0x8000u : 0x4000u); addr++) {
+            uint8_t f = flags[key(bank, addr)];
+            if ((f & F_CODE) && (f & F_LEADER)) {
+                insts += emit_block(out, bank, addr);
+                blocks++;
+            }
+        }
+    }
+
+    fprintf(out, "int %s(CPU *cpu, uint32_t bank, uint16_t pc) {\n", AOT_DISPATCH_SYMBOL);
+    fprintf(out, "    switch ((bank << 16) | pc) {\n");
+    for (uint32_t bank = 0; bank < banks; bank++) {
+        for (uint32_t addr = bank ? 0x4000 : 0x0000; addr < (bank ? 0x8000u : 0x4000u); addr++) {
+            uint8_t f = flags[key(bank, addr)];
+            if ((f & F_CODE) && (f & F_LEADER))
+                fprintf(out, "        case 0x%08X: b%03X_%04X(cpu); return 1;\n",
+                        (bank << 16) | addr, bank, addr);
+        }
+    }
+    fprintf(out, "    }\n    return 0;\n}\n");
+    fclose(out);
+
+    printf("%s: %u blocks, %u instructions in %u banks\n", out_path, blocks, insts, banks);
+    free(flags);
+    free(work);
+    free(rom);
+    return 0;
+}
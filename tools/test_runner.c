@@ -0,0 +1,419 @@
+/* Runs a directory of test ROMs headless, one worker process per core.
+
+    ./bin/test_runner ./roms                       # every .gb/.gbc in ./roms
+    ./bin/test_runner ./roms -j 4                  # limit to 4 workers
+    ./bin/test_runner ./roms -timeout 100000000    # per-ROM budget in emulated T-cycles
+    ./bin/test_runner ./roms -json out.json -junit out.xml
+    ./bin/test_runner ./roms -record               # fill in every <rom>.hash from this run
+    ./bin/test_runner ./roms -dmg                  # CGB ROMs too run as DMG ones (dmg-only test suites)
+
+    A ROM passes when one of these says so (checked in this order):
+      hash   - a <rom>.hash file next to the ROM holds the expected frame hash
+               (see frame_hash, shades only so the palette doesn't matter),
+               compared when the ROM hits LD B,B. "<hash> <frame>" compares
+               the frame-th published frame instead, for ROMs that never stop
+      fib    - mooneye style: LD B,B with B,C,D,E,H,L = 3,5,8,13,21,34
+      serial - blargg style: "Passed" (or "Failed") shows up on the serial port
+
+    Each ROM runs in its own forked process, so the global emulator state
+    (rom, serial_log, bootrom_flag...) never gets shared between tests.
+*/
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "emu.h"
+#include "cpu.h"
+
+#define DEFAULT_TIMEOUT (120ULL * CPU_FREQUENCY) // two emulated minutes
+
+typedef enum {
+    RESULT_PASS,
+    RESULT_FAIL,
+    RESULT_TIMEOUT,
+    RESULT_ERROR
+} result_status;
+
+static const char *STATUS_NAMES[] = {"pass", "fail", "timeout", "error"};
+
+typedef struct {
+    result_status status;
+    char criterion[8];      // hash, fib, serial or none
+    uint64_t cycles;        // emulated T-cycles until the verdict
+    uint64_t hash;          // frame hash at the verdict
+    double seconds;         // wall time of the worker
+    char message[256];
+} TestResult;
+
+typedef struct {
+    char path[1024];
+    char name[256];
+    TestResult result;
+    pid_t pid;
+    int pipe_fd;
+} TestCase;
+
+static TestCase *tests = NULL; // grows while the directory is read
+static int test_count = 0;
+static int test_capacity = 0;
+
+static CPU cpu;
+static bool record = false;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void hash_path_of(const char *rom_path, char *hash_path) {
+    strcpy(hash_path, rom_path);
+    char *dot = strrchr(hash_path, '.');
+    if (dot) *dot = '\0';
+    strcat(hash_path, ".hash");
+}
+
+/* Looks for <rom without extension>.hash, returns false if there is none.
+   frame is 0 unless the file names one, an empty file is a hash still to be recorded. */
+static bool read_expected_hash(const char *rom_path, uint64_t *hash, uint32_t *frame) {
+    char hash_path[1100];
+    hash_path_of(rom_path, hash_path);
+
+    FILE *f = fopen(hash_path, "r");
+    if (!f) return false;
+    unsigned long long value;
+    unsigned frame_number = 0;
+    int n = fscanf(f, "%llx %u", &value, &frame_number);
+    fclose(f);
+    *hash = (n >= 1) ? value : 0;
+    *frame = (n == 2) ? frame_number : 0;
+    return true;
+}
+
+static bool write_hash(const char *rom_path, uint64_t hash, uint32_t frame) {
+    char hash_path[1100];
+    hash_path_of(rom_path, hash_path);
+
+    FILE *f = fopen(hash_path, "w");
+    if (!f) return false;
+    if (frame)
+        fprintf(f, "%016llx %u\n", (unsigned long long)hash, frame);
+    else
+        fprintf(f, "%016llx\n", (unsigned long long)hash);
+    fclose(f);
+    return true;
+}
+
+// The hash criterion's verdict (or with -record, the new golden value)
+static void check_hash(TestResult *res, const char *path, uint64_t expected_hash, uint32_t hash_frame) {
+    strcpy(res->criterion, "hash");
+    if (record) {
+        res->status = write_hash(path, res->hash, hash_frame) ? RESULT_PASS : RESULT_ERROR;
+        snprintf(res->message, sizeof(res->message), "recorded %016llx", (unsigned long long)res->hash);
+        return;
+    }
+    res->status = (res->hash == expected_hash) ? RESULT_PASS : RESULT_FAIL;
+    if (res->status == RESULT_FAIL)
+        snprintf(res->message, sizeof(res->message), "expected hash %016llx got %016llx",
+                 (unsigned long long)expected_hash, (unsigned long long)res->hash);
+}
+
+static void run_test(const char *path, uint64_t timeout, TestResult *res) {
+    double start = now_seconds();
+    memset(res, 0, sizeof(*res));
+    strcpy(res->criterion, "none");
+
+    uint64_t expected_hash = 0;
+    uint32_t hash_frame = 0;
+    bool use_hash = read_expected_hash(path, &expected_hash, &hash_frame);
+
+    current_mode = TEST;
+    GAMEBOY_COLOURS = DMG_COLOURS;
+    bootrom_flag = false;
+    inputRom = (char *)path;
+    start_cpu_noboot(&cpu);
+
+    if (!load_rom(&cpu, path)) {
+        res->status = RESULT_ERROR;
+        snprintf(res->message, sizeof(res->message), "could not load ROM");
+        return;
+    }
+
+    size_t seen_serial = 0;
+    res->status = RESULT_TIMEOUT;
+
+    while (cpu.total_cycles < timeout) {
+        // the frame the hash file asks for was just published
+        if (hash_frame && cpu.ppu.frame_seq >= hash_frame) {
+            res->hash = frame_hash(ppu_acquire_frame(&cpu.ppu));
+            check_hash(res, path, expected_hash, hash_frame);
+            break;
+        }
+
+        // LD B,B is the breakpoint mooneye, dmg-acid2 and mealybug-tearoom use when done
+        if (!hash_frame && read8(&cpu, cpu.pc) == 0x40) {
+            res->hash = frame_hash(ppu_acquire_frame(&cpu.ppu));
+            Registers *r = &cpu.regs;
+
+            if (use_hash)
+                check_hash(res, path, expected_hash, 0);
+            else {
+                strcpy(res->criterion, "fib");
+                bool success = (r->b == 0x03 && r->c == 0x05 && r->d == 0x08 &&
+                                r->e == 0x0D && r->h == 0x15 && r->l == 0x22);
+                res->status = success ? RESULT_PASS : RESULT_FAIL;
+                if (!success)
+                    snprintf(res->message, sizeof(res->message), "expected 03 05 08 0D 15 22 got %02X %02X %02X %02X %02X %02X",
+                             r->b, r->c, r->d, r->e, r->h, r->l);
+            }
+            break;
+        }
+
+        cpu_step(&cpu);
+
+        if (serial_len != seen_serial) {
+            seen_serial = serial_len;
+            serial_log[serial_len] = '\0';
+            if (!use_hash && strstr(serial_log, "Passed")) {
+                strcpy(res->criterion, "serial");
+                res->status = RESULT_PASS;
+                break;
+            }
+            if (!use_hash && strstr(serial_log, "Failed")) {
+                strcpy(res->criterion, "serial");
+                res->status = RESULT_FAIL;
+                break;
+            }
+        }
+    }
+
+    res->cycles = cpu.total_cycles;
+    if (res->status == RESULT_TIMEOUT)
+        snprintf(res->message, sizeof(res->message), "no verdict after %llu cycles", (unsigned long long)timeout);
+
+    // a failing serial test explains itself, keep the tail of the log
+    if (res->status != RESULT_PASS && res->message[0] == '\0' && serial_len > 0) {
+        size_t tail = serial_len > sizeof(res->message) - 1 ? serial_len - (sizeof(res->message) - 1) : 0;
+        snprintf(res->message, sizeof(res->message), "%s", serial_log + tail);
+    }
+    res->seconds = now_seconds() - start;
+}
+
+static void spawn(TestCase *t, uint64_t timeout) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        t->result.status = RESULT_ERROR;
+        snprintf(t->result.message, sizeof(t->result.message), "pipe failed");
+        t->pid = -1;
+        return;
+    }
+
+    // the child would otherwise flush our pending output a second time
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        // load_rom and friends are chatty
+        if (!freopen("/dev/null", "w", stdout)) {}
+        TestResult res;
+        run_test(t->path, timeout, &res);
+        if (write(fds[1], &res, sizeof(res)) != sizeof(res)) _exit(2);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    t->pid = pid;
+    t->pipe_fd = fds[0];
+    if (pid < 0) {
+        close(fds[0]);
+        t->result.status = RESULT_ERROR;
+        snprintf(t->result.message, sizeof(t->result.message), "fork failed");
+    }
+}
+
+static void collect(TestCase *t, int wstatus) {
+    if (read(t->pipe_fd, &t->result, sizeof(t->result)) != sizeof(t->result)) {
+        memset(&t->result, 0, sizeof(t->result));
+        t->result.status = RESULT_ERROR;
+        strcpy(t->result.criterion, "none");
+        if (WIFSIGNALED(wstatus))
+            snprintf(t->result.message, sizeof(t->result.message), "worker died with signal %d", WTERMSIG(wstatus));
+        else
+            snprintf(t->result.message, sizeof(t->result.message), "worker exited without a result");
+    }
+    close(t->pipe_fd);
+    t->pid = 0;
+}
+
+static int compare_tests(const void *a, const void *b) {
+    return strcmp(((const TestCase *)a)->name, ((const TestCase *)b)->name);
+}
+
+static bool is_rom(const char *name) {
+    const char *dot = strrchr(name, '.');
+    return dot && (strcmp(dot, ".gb") == 0 || strcmp(dot, ".gbc") == 0);
+}
+
+static void write_escaped(FILE *f, const char *s, bool xml) {
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (xml && c == '<') fputs("&lt;", f);
+        else if (xml && c == '>') fputs("&gt;", f);
+        else if (xml && c == '&') fputs("&amp;", f);
+        else if (c == '"') fputs(xml ? "&quot;" : "\\\"", f);
+        else if (!xml && c == '\\') fputs("\\\\", f);
+        else if (c < 0x20) fprintf(f, xml ? "&#%d;" : "\\u%04x", c);
+        else fputc(c, f);
+    }
+}
+
+static void write_json(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        printf("Error: Could not open %s for writing\n", path);
+        return;
+    }
+    fprintf(f, "[\n");
+    for (int i = 0; i < test_count; i++) {
+        TestResult *r = &tests[i].result;
+        fprintf(f, "  {\"name\": \"");
+        write_escaped(f, tests[i].name, false);
+        fprintf(f, "\", \"status\": \"%s\", \"criterion\": \"%s\", \"cycles\": %llu, "
+                   "\"hash\": \"%016llx\", \"seconds\": %.3f, \"message\": \"",
+                STATUS_NAMES[r->status], r->criterion, (unsigned long long)r->cycles,
+                (unsigned long long)r->hash, r->seconds);
+        write_escaped(f, r->message, false);
+        fprintf(f, "\"}%s\n", i + 1 < test_count ? "," : "");
+    }
+    fprintf(f, "]\n");
+    fclose(f);
+}
+
+static void write_junit(const char *path, int failures, int errors, double seconds) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        printf("Error: Could not open %s for writing\n", path);
+        return;
+    }
+    fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    fprintf(f, "<testsuite name=\"admge\" tests=\"%d\" failures=\"%d\" errors=\"%d\" time=\"%.3f\">\n",
+            test_count, failures, errors, seconds);
+    for (int i = 0; i < test_count; i++) {
+        TestResult *r = &tests[i].result;
+        fprintf(f, "  <testcase classname=\"admge\" name=\"");
+        write_escaped(f, tests[i].name, true);
+        fprintf(f, "\" time=\"%.3f\">", r->seconds);
+        if (r->status == RESULT_FAIL || r->status == RESULT_TIMEOUT) {
+            fprintf(f, "<failure type=\"%s\" message=\"", STATUS_NAMES[r->status]);
+            write_escaped(f, r->message, true);
+            fprintf(f, "\"/>");
+        }
+        else if (r->status == RESULT_ERROR) {
+            fprintf(f, "<error message=\"");
+            write_escaped(f, r->message, true);
+            fprintf(f, "\"/>");
+        }
+        fprintf(f, "</testcase>\n");
+    }
+    fprintf(f, "</testsuite>\n");
+    fclose(f);
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir_path = NULL;
+    const char *json_path = NULL;
+    const char *junit_path = NULL;
+    uint64_t timeout = DEFAULT_TIMEOUT;
+    int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) jobs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-timeout") == 0 && i + 1 < argc) timeout = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-json") == 0 && i + 1 < argc) json_path = argv[++i];
+        else if (strcmp(argv[i], "-junit") == 0 && i + 1 < argc) junit_path = argv[++i];
+        else if (strcmp(argv[i], "-record") == 0) record = true;
+        else if (strcmp(argv[i], "-dmg") == 0) cgb_flag = false;
+        else dir_path = argv[i];
+    }
+    if (jobs < 1) jobs = 1;
+
+    if (!dir_path) {
+        printf("Usage: %s <rom dir> [-j jobs] [-timeout cycles] [-json file] [-junit file] [-record] [-dmg]\n", argv[0]);
+        return 1;
+    }
+
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        printf("Error: Could not open directory %s\n", dir_path);
+        return 1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!is_rom(entry->d_name)) continue;
+        if (test_count == test_capacity) {
+            int capacity = test_capacity ? test_capacity * 2 : 256;
+            TestCase *grown = realloc(tests, capacity * sizeof(TestCase));
+            if (!grown) {
+                printf("Error: Out of memory after %d ROMs\n", test_count);
+                closedir(dir);
+                return 1;
+            }
+            tests = grown;
+            test_capacity = capacity;
+        }
+        TestCase *t = &tests[test_count++];
+        memset(t, 0, sizeof(*t));
+        snprintf(t->path, sizeof(t->path), "%s/%s", dir_path, entry->d_name);
+        snprintf(t->name, sizeof(t->name), "%s", entry->d_name);
+    }
+    closedir(dir);
+    qsort(tests, test_count, sizeof(TestCase), compare_tests);
+
+    printf("Running %d ROMs on %d workers\n", test_count, jobs);
+    fflush(stdout);
+    double start = now_seconds();
+
+    int next = 0, running = 0, done = 0;
+    while (done < test_count) {
+        while (running < jobs && next < test_count) {
+            spawn(&tests[next], timeout);
+            if (tests[next].pid > 0) running++;
+            else done++;
+            next++;
+        }
+
+        int wstatus;
+        pid_t pid = wait(&wstatus);
+        if (pid < 0) break;
+        for (int i = 0; i < next; i++) {
+            if (tests[i].pid != pid) continue;
+            collect(&tests[i], wstatus);
+            running--;
+            done++;
+            TestResult *r = &tests[i].result;
+            printf("[%-7s] %s%s%s\n", STATUS_NAMES[r->status], tests[i].name,
+                   r->message[0] ? " - " : "", r->message);
+            break;
+        }
+    }
+    double elapsed = now_seconds() - start;
+
+    int passed = 0, failures = 0, errors = 0;
+    for (int i = 0; i < test_count; i++) {
+        switch (tests[i].result.status) {
+            case RESULT_PASS: passed++; break;
+            case RESULT_ERROR: errors++; break;
+            default: failures++; break;
+        }
+    }
+    printf("\n%d passed, %d failed, %d errors in %.2fs\n", passed, failures, errors, elapsed);
+
+    if (json_path) write_json(json_path);
+    if (junit_path) write_junit(junit_path, failures, errors, elapsed);
+
+    return (passed == test_count) ? 0 : 1;
+}
@@ -0,0 +1,100 @@
+/* Expands a binary trace written with `admge rom.gb -trace file` into text.
+
+    ./bin/trace_decode trace.bin            # one verbose line per instruction
+    ./bin/trace_decode trace.bin -doctor    # gameboy-doctor log format
+    ./bin/trace_decode trace.bin -o out.txt # write to a file instead of stdout
+*/
+#include <stdio.h>
+#include <string.h>
+#include "trace.h"
+
+#define CHUNK 4096
+
+static void print_text(FILE *out, const TraceRecord *rec) {
+    fprintf(out,
+            "%12llu PC:%04X BANK:%02X OP:%02X %02X %02X %02X | "
+            "AF:%04X BC:%04X DE:%04X HL:%04X SP:%04X IME:%d |",
+            (unsigned long long)rec->cycle, rec->pc, rec->rom_bank,
+            rec->pcmem[0], rec->pcmem[1], rec->pcmem[2], rec->pcmem[3],
+            rec->af, rec->bc, rec->de, rec->hl, rec->sp, rec->ime);
+
+    int shown = rec->n_access < TRACE_MAX_ACCESS ? rec->n_access : TRACE_MAX_ACCESS;
+    for (int i = 0; i < shown; i++) {
+        const TraceAccess *acc = &rec->access[i];
+        fprintf(out, " %c:%04X=%02X", acc->kind == TRACE_ACCESS_WRITE ? 'W' : 'R', acc->addr, acc->value);
+    }
+    if (rec->n_access > shown)
+        fprintf(out, " (+%d)", rec->n_access - shown);
+    fputc('\n', out);
+}
+
+// https://github.com/robert/gameboy-doctor
+static void print_doctor(FILE *out, const TraceRecord *rec) {
+    fprintf(out,
+            "A:%02X F:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X "
+            "SP:%04X PC:%04X PCMEM:%02X,%02X,%02X,%02X\n",
+            rec->af >> 8, rec->af & 0xFF, rec->bc >> 8, rec->bc & 0xFF,
+            rec->de >> 8, rec->de & 0xFF, rec->hl >> 8, rec->hl & 0xFF,
+            rec->sp, rec->pc,
+            rec->pcmem[0], rec->pcmem[1], rec->pcmem[2], rec->pcmem[3]);
+}
+
+int main(int argc, char *argv[]) {
+    const char *in_path = NULL;
+    const char *out_path = NULL;
+    int doctor = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-doctor") == 0) doctor = 1;
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) out_path = argv[++i];
+        else in_path = argv[i];
+    }
+
+    if (!in_path) {
+        printf("Usage: %s trace.bin [-doctor] [-o out.txt]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(in_path, "rb");
+    if (!in) {
+        printf("Error: Could not open %s\n", in_path);
+        return 1;
+    }
+
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        printf("Error: %s is not an admge trace\n", in_path);
+        fclose(in);
+        return 1;
+    }
+    if (header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord)) {
+        printf("Error: Trace version %u (record size %u) is not supported\n",
+               header.version, header.record_size);
+        fclose(in);
+        return 1;
+    }
+
+    FILE *out = stdout;
+    if (out_path) {
+        out = fopen(out_path, "w");
+        if (!out) {
+            printf("Error: Could not open %s for writing\n", out_path);
+            fclose(in);
+            return 1;
+        }
+    }
+
+    static TraceRecord records[CHUNK];
+    size_t count;
+    while ((count = fread(records, sizeof(TraceRecord), CHUNK, in)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            if (doctor) print_doctor(out, &records[i]);
+            else print_text(out, &records[i]);
+        }
+    }
+
+    fclose(in);
+    if (out != stdout) fclose(out);
+    return 0;
+}